@@ -0,0 +1,412 @@
+/* Fuzzer and throughput bench of the protocol codec (ethpwm_proto.h).
+ *
+ * Fuzz mode feeds random frames and mutations of valid frames to the length
+ * check and decoders the same way the receivers do, and checks that encoded
+ * states decode back unchanged. Every frame is copied to a buffer of its exact
+ * length, so build with -fsanitize=address,undefined to catch reads past it.
+ * Bench mode measures encode and decode rate of legacy packets and of full
+ * frames of both record versions.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "ethpwm_proto.h"
+
+#define MAX_FRAME               1500
+#define BENCH_RECORDS           64      /* records per frame in bench mode */
+
+static unsigned long long rnd_state = 1;
+static unsigned long errors;
+static volatile __u32 sink;
+
+static __u32 rnd(void)
+{
+    /* xorshift64* */
+    rnd_state ^= rnd_state >> 12;
+    rnd_state ^= rnd_state << 25;
+    rnd_state ^= rnd_state >> 27;
+    return (__u32) ((rnd_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void fail(const char* what, unsigned long iter)
+{
+    errors++;
+    if(errors <= 10)
+    {
+        fprintf(stderr, "iteration %lu: %s\n", iter, what);
+    }
+}
+
+static void check_state(const ethpwm_state_t* st, unsigned long iter)
+{
+    if(st->duty > ETHPWM_DUTY_ONE)
+    {
+        fail("decoded duty above 1.0", iter);
+    }
+    sink += st->channel + st->enable + st->freq + st->duty;
+}
+
+/* Walks the frame like the receivers do, buf holds exactly len bytes */
+static void decode_frame(const __u8* buf, unsigned int len, unsigned long iter)
+{
+    const pwm_frame_hdr_t* hdr = (const pwm_frame_hdr_t*) buf;
+    const pwm_stream_t* blk;
+    const __be32* duty;
+    ethpwm_state_t st;
+    unsigned int rec_size, off, i, j;
+    int needed;
+
+    if(len < sizeof(pwm_frame_hdr_t))
+    {
+        return;
+    }
+    if(hdr->marker != ETHPWM_EXT_MARKER)
+    {
+        if(len >= sizeof(pwm_packet_t))
+        {
+            ethpwm_decode_packet((const pwm_packet_t*) buf, &st);
+            check_state(&st, iter);
+        }
+        return;
+    }
+    needed = ethpwm_frame_len(buf, len);
+    if(needed < 0 || (unsigned int) needed > len)
+    {
+        return;
+    }
+    switch(hdr->type)
+    {
+        case ETHPWM_FRAME_PWM:
+        case ETHPWM_FRAME_PWM_AT:
+            rec_size = ethpwm_record_size(hdr->version);
+            off = ethpwm_records_offset(hdr);
+            if(!rec_size || off + hdr->count * rec_size != (unsigned int) needed)
+            {
+                fail("record frame length mismatch", iter);
+                return;
+            }
+            for(i = 0; i < hdr->count; i++, off += rec_size)
+            {
+                ethpwm_decode_record(buf + off, hdr->version, &st);
+                check_state(&st, iter);
+            }
+            break;
+        case ETHPWM_FRAME_STREAM:
+            off = sizeof(pwm_frame_hdr_t);
+            for(i = 0; i < hdr->count; i++)
+            {
+                blk = (const pwm_stream_t*) (buf + off);
+                duty = (const __be32*) (blk + 1);
+                for(j = 0; j < blk->samples; j++)
+                {
+                    sink += ntohl(duty[j]);
+                }
+                off += sizeof(pwm_stream_t) + blk->samples * sizeof(__be32);
+            }
+            if(off != (unsigned int) needed)
+            {
+                fail("stream frame length mismatch", iter);
+            }
+            break;
+        case ETHPWM_FRAME_IO:
+            for(i = 0; i < (unsigned int) ETHPWM_IO_BYTES(hdr->count); i++)
+            {
+                sink += buf[sizeof(pwm_frame_hdr_t) + i];
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* Builds a valid frame of random type into buf, returns its length */
+static unsigned int build_frame(__u8* buf)
+{
+    pwm_frame_hdr_t* hdr = (pwm_frame_hdr_t*) buf;
+    pwm_stream_t* blk;
+    ethpwm_state_t st;
+    unsigned int len, off, i, samples;
+    __u8 type = rnd() % (ETHPWM_FRAME_STEP_FB + 1);
+    __u8 version = rnd() & 1 ? ETHPWM_VERSION_32 : ETHPWM_VERSION;
+    __u8 count = rnd() % 16;
+
+    if(type == ETHPWM_FRAME_IO)
+    {
+        count = rnd() % (ETHPWM_MAX_IO + 1);
+    }
+    ethpwm_init_frame(hdr, rnd(), version, type, count);
+    off = ethpwm_records_offset(hdr);
+    switch(type)
+    {
+        case ETHPWM_FRAME_PWM:
+        case ETHPWM_FRAME_PWM_AT:
+            for(i = 0; i < count; i++, off += ethpwm_record_size(version))
+            {
+                st.channel = rnd();
+                st.enable  = rnd() & 1;
+                st.flags   = rnd();
+                st.duty    = rnd();
+                st.freq    = rnd();
+                if(version == ETHPWM_VERSION_32)
+                {
+                    ethpwm_encode_record32((pwm_record32_t*) (buf + off), &st);
+                } else
+                {
+                    ethpwm_encode_record16((pwm_record_t*) (buf + off), st.channel, st.enable,
+                                           rnd(), rnd(), rnd(), rnd());
+                }
+            }
+            break;
+        case ETHPWM_FRAME_STREAM:
+            for(i = 0; i < count; i++)
+            {
+                samples = rnd() % 8;
+                if(off + sizeof(pwm_stream_t) + samples * sizeof(__be32) > MAX_FRAME)
+                {
+                    hdr->count = i;
+                    break;
+                }
+                blk = (pwm_stream_t*) (buf + off);
+                blk->channel = rnd();
+                blk->enable = 1;
+                blk->samples = samples;
+                blk->flags = 0;
+                blk->sample_period = htonl(rnd());
+                blk->freq = htonl(rnd());
+                off += sizeof(pwm_stream_t);
+                memset(buf + off, 0x5A, samples * sizeof(__be32));
+                off += samples * sizeof(__be32);
+            }
+            break;
+        default:
+            break;
+    }
+    len = (unsigned int) ethpwm_frame_len(buf, MAX_FRAME);
+    memset(buf + off, 0, len > off ? len - off : 0);
+    return len;
+}
+
+/* Encoded states must decode back unchanged */
+static void check_roundtrip(unsigned long iter)
+{
+    pwm_packet_t pkt;
+    pwm_record_t rec16;
+    pwm_record32_t rec32;
+    ethpwm_state_t in, out;
+    __u16 value = rnd(), scale = rnd(), freq = rnd();
+
+    in.channel = rnd();
+    in.enable  = rnd() & 1;
+    in.flags   = rnd() & (ETHPWM_FLAG_DIR | ETHPWM_FLAG_PDM);
+    in.duty    = rnd() % (ETHPWM_DUTY_ONE + 1);
+    in.freq    = rnd();
+    ethpwm_encode_record32(&rec32, &in);
+    ethpwm_decode_record(&rec32, ETHPWM_VERSION_32, &out);
+    if(out.channel != in.channel || out.enable != in.enable || out.flags != in.flags ||
+       out.freq != in.freq || out.duty != in.duty)
+    {
+        fail("version 2 record round trip", iter);
+    }
+
+    ethpwm_encode_record16(&rec16, in.channel, in.enable, value, scale, 0, freq);
+    ethpwm_decode_record(&rec16, ETHPWM_VERSION, &out);
+    if(out.channel != in.channel || out.enable != in.enable ||
+       out.freq != (__u32) freq << ETHPWM_FREQ_SHIFT || out.duty != ethpwm_duty16(value, scale))
+    {
+        fail("version 1 record round trip", iter);
+    }
+
+    ethpwm_encode_packet(&pkt, iter, in.channel, in.enable, value, scale, 0, freq);
+    ethpwm_decode_packet(&pkt, &out);
+    if(ntohl(pkt.seq) != (__u32) iter || out.channel != in.channel || out.enable != in.enable ||
+       out.freq != (__u32) freq << ETHPWM_FREQ_SHIFT || out.duty != ethpwm_duty16(value, scale))
+    {
+        fail("legacy packet round trip", iter);
+    }
+}
+
+static void fuzz(unsigned long iterations)
+{
+    __u8 frame[MAX_FRAME];
+    __u8* buf;
+    unsigned long iter;
+    unsigned int len, i, flips;
+
+    for(iter = 0; iter < iterations; iter++)
+    {
+        if(iter % 4 == 0)
+        {
+            /* random bytes with a plausible header */
+            len = rnd() % 64;
+            for(i = 0; i < len; i++)
+            {
+                frame[i] = rnd();
+            }
+            if(len > 4 && rnd() & 1)
+            {
+                frame[4] = ETHPWM_EXT_MARKER;
+            }
+        } else
+        {
+            /* valid frame, mutated and truncated or extended */
+            len = build_frame(frame);
+            flips = rnd() % 4;
+            for(i = 0; i < flips && len; i++)
+            {
+                frame[rnd() % len] ^= 1 << (rnd() % 8);
+            }
+            if(rnd() & 1)
+            {
+                len = len ? rnd() % (len + 1) : 0;
+            } else if(len < MAX_FRAME && rnd() & 1)
+            {
+                len += rnd() % (MAX_FRAME - len + 1);
+            }
+        }
+        buf = malloc(len ? len : 1);
+        if(!buf)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(buf, frame, len);
+        decode_frame(buf, len, iter);
+        free(buf);
+        check_roundtrip(iter);
+    }
+    printf("fuzz: %lu iterations, %lu errors\n", iterations, errors);
+}
+
+static void report(const char* name, unsigned long records, long long ns)
+{
+    printf("%-24s %8.1f Mrecords/s\n", name, ns > 0 ? records * 1000.0 / ns : 0.0);
+}
+
+static void bench(unsigned long frames)
+{
+    static __u8 buf[BENCH_RECORDS * sizeof(pwm_record32_t) + sizeof(pwm_frame_hdr_t)];
+    pwm_frame_hdr_t* hdr = (pwm_frame_hdr_t*) buf;
+    pwm_packet_t pkt;
+    ethpwm_state_t st = {0};
+    unsigned long records = frames * BENCH_RECORDS;
+    unsigned long f, i;
+    unsigned int rec_size;
+    __u8* rec;
+    long long t;
+    int v;
+
+    t = now_ns();
+    for(i = 0; i < records; i++)
+    {
+        ethpwm_encode_packet(&pkt, i, i & 63, 1, i, 0xFFFF, 0, 1000);
+        sink += pkt.value;
+    }
+    report("legacy encode", records, now_ns() - t);
+    t = now_ns();
+    for(i = 0; i < records; i++)
+    {
+        pkt.value = (__be16) i;
+        ethpwm_decode_packet(&pkt, &st);
+        sink += st.duty;
+    }
+    report("legacy decode", records, now_ns() - t);
+
+    for(v = ETHPWM_VERSION; v <= ETHPWM_VERSION_32; v++)
+    {
+        rec_size = ethpwm_record_size(v);
+        t = now_ns();
+        for(f = 0; f < frames; f++)
+        {
+            ethpwm_init_frame(hdr, f, v, ETHPWM_FRAME_PWM, BENCH_RECORDS);
+            rec = buf + ethpwm_records_offset(hdr);
+            for(i = 0; i < BENCH_RECORDS; i++, rec += rec_size)
+            {
+                if(v == ETHPWM_VERSION_32)
+                {
+                    st.channel = i;
+                    st.enable = 1;
+                    st.duty = (__u32) (f + i) << 16;
+                    st.freq = 1000 << ETHPWM_FREQ_SHIFT;
+                    ethpwm_encode_record32((pwm_record32_t*) rec, &st);
+                } else
+                {
+                    ethpwm_encode_record16((pwm_record_t*) rec, i, 1, f + i, 0xFFFF, 0, 1000);
+                }
+            }
+            sink += buf[sizeof(pwm_frame_hdr_t) + (f & 15)];
+        }
+        report(v == ETHPWM_VERSION ? "version 1 encode" : "version 2 encode", records, now_ns() - t);
+
+        t = now_ns();
+        for(f = 0; f < frames; f++)
+        {
+            buf[sizeof(pwm_frame_hdr_t) + 2] = f;
+            if(ethpwm_frame_len(buf, sizeof(buf)) < 0)
+            {
+                continue;
+            }
+            rec = buf + ethpwm_records_offset(hdr);
+            for(i = 0; i < hdr->count; i++, rec += rec_size)
+            {
+                ethpwm_decode_record(rec, hdr->version, &st);
+                sink += st.duty;
+            }
+        }
+        report(v == ETHPWM_VERSION ? "version 1 decode" : "version 2 decode", records, now_ns() - t);
+    }
+}
+
+static void print_usage(void)
+{
+    printf("Fuzzer and throughput bench of the ethpwm protocol codec.\n\n"
+           "Supported arguments:\n"
+           "--fuzz=N           - number of fuzz iterations (default 1000000, 0 - no fuzzing)\n"
+           "--bench=N          - number of frames of %d records to encode and decode (default 1000000, 0 - no bench)\n"
+           "--seed=N           - random seed (default 1)\n", BENCH_RECORDS);
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned long iterations = 1000000;
+    unsigned long frames = 1000000;
+    int c, option_index;
+    struct option long_options[] = {
+            {"fuzz",  required_argument, 0, 'f'},
+            {"bench", required_argument, 0, 'b'},
+            {"seed",  required_argument, 0, 's'},
+            {0,       0,                 0, 0}
+    };
+
+    while((c = getopt_long(argc, argv, "f:b:s:", long_options, &option_index)) != -1)
+    {
+        switch(c)
+        {
+            case 'f': iterations = strtoul(optarg, NULL, 10); break;
+            case 'b': frames = strtoul(optarg, NULL, 10); break;
+            case 's': rnd_state = strtoull(optarg, NULL, 10) | 1; break;
+            default:
+                print_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(iterations)
+    {
+        fuzz(iterations);
+    }
+    if(frames)
+    {
+        bench(frames);
+    }
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
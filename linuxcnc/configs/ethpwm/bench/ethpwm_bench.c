@@ -0,0 +1,418 @@
+/* Loopback bench for the ethpwm protocol.
+ *
+ * Sender is ethpwm.c itself (uspace build) running on the HAL shim, so frames
+ * are built and sent by the same code as in LinuxCNC. Receiver is a stand-in for
+ * the kernel module: it runs in a thread on the other end of a veth pair,
+ * which is placed into a network namespace, and acks frames like ethpwm_mod.c.
+ * Both ends use CLOCK_MONOTONIC, so one-way latency of each frame is measured.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+#include <linux/types.h>
+#include <endian.h>
+#include "rtapi.h"
+#include "rtapi_app.h"
+#include "hal.h"
+#include "ethpwm_proto.h"
+
+#define MAX_CHANNELS            64
+#define BUF_SIZ                 2048
+
+/* Receiver results, rx_time is indexed by frame seq */
+typedef struct
+{
+    int             sock;
+    volatile int    stop;
+    unsigned int    max_frames;
+    long long*      rx_time;
+    unsigned long   frames;
+    unsigned long   records;
+    unsigned long   bytes;
+    unsigned long   gaps;
+    unsigned long   syncs;
+    int             seq_init;
+    __u32           last_seq;
+} peer_t;
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Opens packet socket on iface inside network namespace ns, returns socket and MAC of iface */
+static int open_peer_socket(const char* ns, const char* iface, unsigned char* mac)
+{
+    char path[128];
+    int ns_fd, own_fd, sock;
+    struct ifreq ifr;
+    struct sockaddr_ll addr;
+    struct timeval tv = {0, 100000};
+
+    own_fd = open("/proc/self/ns/net", O_RDONLY);
+    snprintf(path, sizeof(path), "/var/run/netns/%s", ns);
+    ns_fd = open(path, O_RDONLY);
+    if(own_fd < 0 || ns_fd < 0 || setns(ns_fd, CLONE_NEWNET) < 0)
+    {
+        perror("setns");
+        return -1;
+    }
+    /* socket stays in the namespace it is created in */
+    sock = socket(AF_PACKET, SOCK_RAW, htons(ETHPWM_ETHERTYPE));
+    if(sock >= 0)
+    {
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, iface, IFNAMSIZ - 1);
+        if(ioctl(sock, SIOCGIFHWADDR, &ifr) < 0)
+        {
+            perror("SIOCGIFHWADDR");
+            close(sock);
+            sock = -1;
+        } else
+        {
+            memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+            memset(&addr, 0, sizeof(addr));
+            addr.sll_family   = AF_PACKET;
+            addr.sll_protocol = htons(ETHPWM_ETHERTYPE);
+            addr.sll_ifindex  = if_nametoindex(iface);
+            bind(sock, (struct sockaddr*) &addr, sizeof(addr));
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        }
+    } else
+    {
+        perror("socket");
+    }
+    setns(own_fd, CLONE_NEWNET);
+    close(own_fd);
+    close(ns_fd);
+    return sock;
+}
+
+/* Sends ack or sync reply back to the frame source, as ethpwm_mod.c does */
+static void peer_reply(peer_t* peer, const unsigned char* rx, int type, const void* payload, size_t len)
+{
+    unsigned char buf[BUF_SIZ];
+    struct ether_header* eh = (struct ether_header*) buf;
+    const struct ether_header* rx_eh = (const struct ether_header*) rx;
+    pwm_frame_hdr_t* hdr = (pwm_frame_hdr_t*) (buf + ETH_HLEN);
+    const pwm_frame_hdr_t* rx_hdr = (const pwm_frame_hdr_t*) (rx + ETH_HLEN);
+
+    memcpy(eh->ether_dhost, rx_eh->ether_shost, ETH_ALEN);
+    memcpy(eh->ether_shost, rx_eh->ether_dhost, ETH_ALEN);
+    eh->ether_type = htons(ETHPWM_ETHERTYPE);
+    *hdr = *rx_hdr;
+    hdr->type = type;
+    hdr->count = 0;
+    memcpy(hdr + 1, payload, len);
+    send(peer->sock, buf, ETH_HLEN + sizeof(pwm_frame_hdr_t) + len, MSG_DONTWAIT);
+}
+
+static void peer_seq(peer_t* peer, __u32 seq, long long t)
+{
+    if(peer->seq_init && seq != peer->last_seq + 1)
+    {
+        peer->gaps++;
+    }
+    peer->seq_init = 1;
+    peer->last_seq = seq;
+    if(seq < peer->max_frames)
+    {
+        peer->rx_time[seq] = t;
+    }
+}
+
+static void* peer_thread(void* arg)
+{
+    peer_t* peer = (peer_t*) arg;
+    unsigned char buf[BUF_SIZ];
+    const pwm_frame_hdr_t* hdr = (const pwm_frame_hdr_t*) (buf + ETH_HLEN);
+    pwm_sync_t sync;
+    struct sockaddr_ll from;
+    socklen_t from_len;
+    ssize_t len;
+    long long t;
+
+    while(!peer->stop)
+    {
+        from_len = sizeof(from);
+        len = recvfrom(peer->sock, buf, sizeof(buf), 0, (struct sockaddr*) &from, &from_len);
+        t = now_ns();
+        if(len < (ssize_t) (ETH_HLEN + sizeof(pwm_frame_hdr_t)) || from.sll_pkttype == PACKET_OUTGOING)
+        {
+            continue;
+        }
+        if(hdr->marker != ETHPWM_EXT_MARKER)
+        {
+            /* legacy single channel packet */
+            peer->frames++;
+            peer->records++;
+            peer->bytes += len;
+            peer_seq(peer, ntohl(hdr->seq), t);
+            continue;
+        }
+        switch(hdr->type)
+        {
+            case ETHPWM_FRAME_SYNC:
+                if(len < (ssize_t) (ETH_HLEN + sizeof(pwm_frame_hdr_t) + sizeof(pwm_sync_t)))
+                {
+                    break;
+                }
+                memcpy(&sync, hdr + 1, sizeof(sync));
+                sync.t2 = htobe64(t);
+                sync.t3 = htobe64(now_ns());
+                peer_reply(peer, buf, ETHPWM_FRAME_SYNC, &sync, sizeof(sync));
+                peer->syncs++;
+                break;
+            case ETHPWM_FRAME_PWM:
+            case ETHPWM_FRAME_PWM_AT:
+            case ETHPWM_FRAME_STREAM:
+                peer->frames++;
+                peer->records += hdr->count;
+                peer->bytes += len;
+                peer_seq(peer, ntohl(hdr->seq), t);
+                peer_reply(peer, buf, ETHPWM_FRAME_ACK, NULL, 0);
+                break;
+            default:
+                break;
+        }
+    }
+    return NULL;
+}
+
+static int cmp_ll(const void* a, const void* b)
+{
+    long long x = *(const long long*) a;
+    long long y = *(const long long*) b;
+    return x < y ? -1 : x > y;
+}
+
+static hal_u32_t* u32_pin(const char* name)
+{
+    hal_u32_t* p = (hal_u32_t*) hal_shim_find(name);
+    if(!p)
+    {
+        fprintf(stderr, "pin %s is not found\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static void print_usage(void)
+{
+    printf("Loopback bench for ethpwm protocol.\n\n"
+           "Supported arguments:\n"
+           "--netns=NAME       - network namespace of the receiver end (required)\n"
+           "--iface=IFACE      - sender interface (required)\n"
+           "--peer=IFACE       - receiver interface inside the namespace (required)\n"
+           "--channels=N       - number of channels (default 1)\n"
+           "--rate=R           - probability of a channel change per period, 0..1 (default 1)\n"
+           "--period=NS        - servo period, ns (default 1000000)\n"
+           "--duration=S       - bench duration, seconds (default 5)\n"
+           "--param=NAME=VALUE - additional ethpwm module parameter, can be repeated\n"
+           "--header           - print column names\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* netns = NULL;
+    const char* iface = NULL;
+    const char* peer_iface = NULL;
+    int channels = 1;
+    double rate = 1.0;
+    long period = 1000000;
+    double duration = 5.0;
+    const char* params[16];
+    int num_params = 0;
+    int header = 0;
+    unsigned char peer_mac[ETH_ALEN];
+    char buf[64];
+    peer_t peer;
+    pthread_t thread;
+    long long* tx_time;
+    long long* lat;
+    double acc[MAX_CHANNELS];
+    hal_float_t* value[MAX_CHANNELS];
+    hal_bit_t* enable[MAX_CHANNELS];
+    hal_u32_t* tx_frames;
+    hal_u32_t* retransmits;
+    struct timespec next;
+    unsigned int periods, sent, p, i, n;
+    long long t;
+    int c, option_index;
+    struct option long_options[] = {
+            {"netns",    required_argument, 0, 'n'},
+            {"iface",    required_argument, 0, 'i'},
+            {"peer",     required_argument, 0, 'I'},
+            {"channels", required_argument, 0, 'c'},
+            {"rate",     required_argument, 0, 'r'},
+            {"period",   required_argument, 0, 'p'},
+            {"duration", required_argument, 0, 'd'},
+            {"param",    required_argument, 0, 'o'},
+            {"header",   no_argument,       0, 'H'},
+            {0,          0,                 0, 0}
+    };
+
+    while((c = getopt_long(argc, argv, "n:i:I:c:r:p:d:o:H", long_options, &option_index)) != -1)
+    {
+        switch(c)
+        {
+            case 'n': netns = optarg; break;
+            case 'i': iface = optarg; break;
+            case 'I': peer_iface = optarg; break;
+            case 'c': channels = atoi(optarg); break;
+            case 'r': rate = atof(optarg); break;
+            case 'p': period = atol(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'o':
+                if(num_params < 16)
+                {
+                    params[num_params++] = optarg;
+                }
+                break;
+            case 'H': header = 1; break;
+            default:
+                print_usage();
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(!netns || !iface || !peer_iface || channels < 1 || channels > MAX_CHANNELS || period <= 0)
+    {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if(header)
+    {
+        printf("%8s %6s %10s %8s %8s %10s %6s %6s %8s %8s %8s %8s %8s %8s\n", "channels", "rate", "period", "sent", "received",
+               "frames/s", "gaps", "lost", "retrans", "p50_us", "p90_us", "p99_us", "p999_us", "max_us");
+    }
+
+    memset(&peer, 0, sizeof(peer));
+    peer.sock = open_peer_socket(netns, peer_iface, peer_mac);
+    if(peer.sock < 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    periods = (unsigned int) (duration * 1e9 / period);
+    peer.max_frames = periods + 1;
+    peer.rx_time = calloc(peer.max_frames, sizeof(long long));
+    tx_time = calloc(peer.max_frames, sizeof(long long));
+    lat = calloc(peer.max_frames, sizeof(long long));
+    if(!peer.rx_time || !tx_time || !lat)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    /* load ethpwm as loadrt would do */
+    snprintf(buf, sizeof(buf), "%d", channels);
+    rtapi_shim_set_param("channels", buf);
+    rtapi_shim_set_param("iface", iface);
+    snprintf(buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x", peer_mac[0], peer_mac[1], peer_mac[2],
+             peer_mac[3], peer_mac[4], peer_mac[5]);
+    rtapi_shim_set_param("dst", buf);
+    for(i = 0; i < (unsigned int) num_params; i++)
+    {
+        char name[32];
+        const char* eq = strchr(params[i], '=');
+        if(!eq || eq - params[i] >= (int) sizeof(name))
+        {
+            fprintf(stderr, "incorrect parameter %s\n", params[i]);
+            exit(EXIT_FAILURE);
+        }
+        memcpy(name, params[i], eq - params[i]);
+        name[eq - params[i]] = 0;
+        if(rtapi_shim_set_param(name, eq + 1) != 0)
+        {
+            fprintf(stderr, "unknown parameter %s\n", name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(rtapi_app_main() != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < (unsigned int) channels; i++)
+    {
+        snprintf(buf, sizeof(buf), "ethpwm.%u.value", i);
+        value[i] = (hal_float_t*) hal_shim_find(buf);
+        snprintf(buf, sizeof(buf), "ethpwm.%u.enable", i);
+        enable[i] = (hal_bit_t*) hal_shim_find(buf);
+        snprintf(buf, sizeof(buf), "ethpwm.%u.pwm-freq", i);
+        *(hal_float_t*) hal_shim_find(buf) = 1000.0;
+        snprintf(buf, sizeof(buf), "ethpwm.%u.scale", i);
+        *(hal_float_t*) hal_shim_find(buf) = 100.0;
+        *enable[i] = 1;
+        /* spread changes of channels over periods */
+        acc[i] = (double) i / channels;
+    }
+    tx_frames = u32_pin("ethpwm.node.0.tx-frames");
+    retransmits = u32_pin("ethpwm.retransmit-count");
+
+    pthread_create(&thread, NULL, peer_thread, &peer);
+
+    /* servo thread */
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for(p = 0; p < periods; p++)
+    {
+        next.tv_nsec += period;
+        while(next.tv_nsec >= 1000000000)
+        {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        for(i = 0; i < (unsigned int) channels; i++)
+        {
+            acc[i] += rate;
+            if(acc[i] >= 1.0)
+            {
+                acc[i] -= 1.0;
+                *value[i] = (double) ((int) (*value[i] + 1) % 100);
+            }
+        }
+        n = *tx_frames;
+        t = now_ns();
+        hal_shim_call("ethpwm.update", period);
+        /* frames of node 0 are numbered from 0, one frame per period at most */
+        if(*tx_frames != n && n < peer.max_frames)
+        {
+            tx_time[n] = t;
+        }
+    }
+    /* wait for the last frames */
+    usleep(200000);
+    peer.stop = 1;
+    pthread_join(thread, NULL);
+    rtapi_app_exit();
+
+    sent = *tx_frames;
+    for(i = 0, n = 0; i < sent && i < peer.max_frames; i++)
+    {
+        if(tx_time[i] && peer.rx_time[i])
+        {
+            lat[n++] = peer.rx_time[i] - tx_time[i];
+        }
+    }
+    qsort(lat, n, sizeof(long long), cmp_ll);
+#define PCT(q) (n ? lat[(unsigned int) ((n - 1) * (q))] / 1000.0 : 0.0)
+    printf("%8d %6.3f %10ld %8u %8lu %10.1f %6lu %6lu %8u %8.1f %8.1f %8.1f %8.1f %8.1f\n", channels, rate, period, sent,
+           peer.frames, peer.frames / duration, peer.gaps, sent > peer.frames ? sent - peer.frames : 0,
+           *retransmits, PCT(0.5), PCT(0.9), PCT(0.99), PCT(0.999), PCT(1.0));
+    return 0;
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Loopback bench for ethpwm protocol. Creates a veth pair with the receiver end
+# in a network namespace and runs ethpwm_bench for 1..MAX_CHANNELS channels,
+# several change rates and both protocol versions. Must be run as root.
+#
+# Usage: ./run_bench.sh [MAX_CHANNELS] [DURATION_S] [PERIOD_NS]
+
+set -e
+
+MAX_CHANNELS=${1:-16}
+DURATION=${2:-5}
+PERIOD=${3:-1000000}
+NS=ethpwm-bench
+IFACE=ethpwm-b0
+PEER=ethpwm-b1
+DIR=$(dirname "$0")
+
+cleanup()
+{
+    ip link del $IFACE 2>/dev/null || true
+    ip netns del $NS 2>/dev/null || true
+}
+
+gcc -O2 -Wall -I"$DIR/shim" -I"$DIR/.." -o "$DIR/ethpwm_bench" "$DIR/ethpwm_bench.c" "$DIR/shim/hal_shim.c" "$DIR/../ethpwm.c" -lpthread
+
+cleanup
+trap cleanup EXIT
+ip netns add $NS
+ip link add $IFACE type veth peer name $PEER
+ip link set $PEER netns $NS
+ip link set $IFACE up
+ip netns exec $NS ip link set $PEER up
+
+for proto in 1 2; do
+    echo "proto=$proto"
+    HEADER=--header
+    ch=1
+    while [ $ch -le $MAX_CHANNELS ]; do
+        for rate in 1 0.1 0.01; do
+            "$DIR/ethpwm_bench" --netns=$NS --iface=$IFACE --peer=$PEER --channels=$ch --rate=$rate \
+                --period=$PERIOD --duration=$DURATION --param=proto=$proto $HEADER
+            HEADER=
+        done
+        ch=$((ch * 2))
+    done
+done
@@ -0,0 +1,49 @@
+/* Minimal HAL for running ethpwm.c as a plain process (loopback bench only).
+   Pins and params are plain memory cells which the bench finds by name. */
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdbool.h>
+#include "rtapi.h"
+
+typedef volatile bool hal_bit_t;
+typedef volatile rtapi_u32 hal_u32_t;
+typedef volatile rtapi_s32 hal_s32_t;
+typedef volatile double hal_float_t;
+
+typedef enum
+{
+    HAL_IN  = 16,
+    HAL_OUT = 32,
+    HAL_IO  = (HAL_IN | HAL_OUT),
+} hal_pin_dir_t;
+
+typedef enum
+{
+    HAL_RO = 64,
+    HAL_RW = 192,
+} hal_param_dir_t;
+
+int hal_init(const char* name);
+int hal_exit(int comp_id);
+int hal_ready(int comp_id);
+void* hal_malloc(long size);
+
+int hal_pin_bit_newf(hal_pin_dir_t dir, hal_bit_t** data_ptr_addr, int comp_id, const char* fmt, ...);
+int hal_pin_float_newf(hal_pin_dir_t dir, hal_float_t** data_ptr_addr, int comp_id, const char* fmt, ...);
+int hal_pin_u32_newf(hal_pin_dir_t dir, hal_u32_t** data_ptr_addr, int comp_id, const char* fmt, ...);
+int hal_pin_s32_newf(hal_pin_dir_t dir, hal_s32_t** data_ptr_addr, int comp_id, const char* fmt, ...);
+
+int hal_param_bit_newf(hal_param_dir_t dir, hal_bit_t* data_addr, int comp_id, const char* fmt, ...);
+int hal_param_float_newf(hal_param_dir_t dir, hal_float_t* data_addr, int comp_id, const char* fmt, ...);
+int hal_param_u32_newf(hal_param_dir_t dir, hal_u32_t* data_addr, int comp_id, const char* fmt, ...);
+int hal_param_s32_newf(hal_param_dir_t dir, hal_s32_t* data_addr, int comp_id, const char* fmt, ...);
+
+int hal_export_funct(const char* name, void (*funct)(void*, long), void* arg, int uses_fp, int reentrant, int comp_id);
+
+/* Returns data of pin or param name or NULL */
+volatile void* hal_shim_find(const char* name);
+/* Calls exported function name, returns -1 if it is not exported */
+int hal_shim_call(const char* name, long period);
+
+#endif
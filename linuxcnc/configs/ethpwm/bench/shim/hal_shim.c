@@ -0,0 +1,238 @@
+/* Minimal HAL and RTAPI implementation for the loopback bench */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include "rtapi.h"
+#include "hal.h"
+
+#define MAX_PARAMS      32
+#define MAX_OBJECTS     4096
+#define MAX_FUNCTS      8
+#define NAME_LEN        48
+
+typedef struct
+{
+    const char* name;
+    int         type;
+    void*       addr;
+    int         count;
+} mp_entry_t;
+
+typedef struct
+{
+    char            name[NAME_LEN];
+    volatile void*  data;
+} hal_object_t;
+
+typedef struct
+{
+    char    name[NAME_LEN];
+    void    (*funct)(void*, long);
+    void*   arg;
+} hal_funct_t;
+
+static mp_entry_t mp_table[MAX_PARAMS];
+static int mp_count;
+static hal_object_t objects[MAX_OBJECTS];
+static int object_count;
+static hal_funct_t functs[MAX_FUNCTS];
+static int funct_count;
+static int msg_level = RTAPI_MSG_ERR;
+
+void rtapi_print_msg(int level, const char* fmt, ...)
+{
+    va_list ap;
+
+    if(level > msg_level)
+    {
+        return;
+    }
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+int rtapi_get_msg_level(void)
+{
+    return msg_level;
+}
+
+int rtapi_set_msg_level(int level)
+{
+    msg_level = level;
+    return 0;
+}
+
+long long rtapi_get_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void rtapi_mp_register(const char* name, int type, void* addr, int count)
+{
+    if(mp_count < MAX_PARAMS)
+    {
+        mp_table[mp_count].name  = name;
+        mp_table[mp_count].type  = type;
+        mp_table[mp_count].addr  = addr;
+        mp_table[mp_count].count = count;
+        mp_count++;
+    }
+}
+
+int rtapi_shim_set_param(const char* name, const char* value)
+{
+    int i, n;
+    char* copy;
+    char* tok;
+    char* save;
+
+    for(i = 0; i < mp_count; i++)
+    {
+        if(strcmp(mp_table[i].name, name))
+        {
+            continue;
+        }
+        switch(mp_table[i].type)
+        {
+            case RTAPI_MP_TYPE_INT:
+                *(int*) mp_table[i].addr = atoi(value);
+                return 0;
+            case RTAPI_MP_TYPE_STRING:
+                *(char**) mp_table[i].addr = strdup(value);
+                return 0;
+            default:
+                copy = strdup(value);
+                for(n = 0, tok = strtok_r(copy, ",", &save); tok && n < mp_table[i].count;
+                    n++, tok = strtok_r(NULL, ",", &save))
+                {
+                    if(mp_table[i].type == RTAPI_MP_TYPE_ARRAY_INT)
+                    {
+                        ((int*) mp_table[i].addr)[n] = atoi(tok);
+                    } else
+                    {
+                        ((char**) mp_table[i].addr)[n] = strdup(tok);
+                    }
+                }
+                free(copy);
+                return 0;
+        }
+    }
+    return -1;
+}
+
+int hal_init(const char* name)
+{
+    return 1;
+}
+
+int hal_exit(int comp_id)
+{
+    return 0;
+}
+
+int hal_ready(int comp_id)
+{
+    return 0;
+}
+
+void* hal_malloc(long size)
+{
+    return calloc(1, size);
+}
+
+static int add_object(volatile void* data, const char* fmt, va_list ap)
+{
+    if(object_count >= MAX_OBJECTS)
+    {
+        return -1;
+    }
+    vsnprintf(objects[object_count].name, NAME_LEN, fmt, ap);
+    objects[object_count].data = data;
+    object_count++;
+    return 0;
+}
+
+/* Pin data is a separate cell, as HAL signal storage */
+#define PIN_NEWF(type, suffix) \
+int hal_pin_##suffix##_newf(hal_pin_dir_t dir, type** data_ptr_addr, int comp_id, const char* fmt, ...) \
+{ \
+    va_list ap; \
+    int ret; \
+    *data_ptr_addr = calloc(1, sizeof(type)); \
+    if(!*data_ptr_addr) \
+    { \
+        return -1; \
+    } \
+    va_start(ap, fmt); \
+    ret = add_object(*data_ptr_addr, fmt, ap); \
+    va_end(ap); \
+    return ret; \
+}
+
+#define PARAM_NEWF(type, suffix) \
+int hal_param_##suffix##_newf(hal_param_dir_t dir, type* data_addr, int comp_id, const char* fmt, ...) \
+{ \
+    va_list ap; \
+    int ret; \
+    va_start(ap, fmt); \
+    ret = add_object(data_addr, fmt, ap); \
+    va_end(ap); \
+    return ret; \
+}
+
+PIN_NEWF(hal_bit_t, bit)
+PIN_NEWF(hal_float_t, float)
+PIN_NEWF(hal_u32_t, u32)
+PIN_NEWF(hal_s32_t, s32)
+PARAM_NEWF(hal_bit_t, bit)
+PARAM_NEWF(hal_float_t, float)
+PARAM_NEWF(hal_u32_t, u32)
+PARAM_NEWF(hal_s32_t, s32)
+
+int hal_export_funct(const char* name, void (*funct)(void*, long), void* arg, int uses_fp, int reentrant, int comp_id)
+{
+    if(funct_count >= MAX_FUNCTS)
+    {
+        return -1;
+    }
+    snprintf(functs[funct_count].name, NAME_LEN, "%s", name);
+    functs[funct_count].funct = funct;
+    functs[funct_count].arg = arg;
+    funct_count++;
+    return 0;
+}
+
+volatile void* hal_shim_find(const char* name)
+{
+    int i;
+
+    for(i = 0; i < object_count; i++)
+    {
+        if(!strcmp(objects[i].name, name))
+        {
+            return objects[i].data;
+        }
+    }
+    return NULL;
+}
+
+int hal_shim_call(const char* name, long period)
+{
+    int i;
+
+    for(i = 0; i < funct_count; i++)
+    {
+        if(!strcmp(functs[i].name, name))
+        {
+            functs[i].funct(functs[i].arg, period);
+            return 0;
+        }
+    }
+    return -1;
+}
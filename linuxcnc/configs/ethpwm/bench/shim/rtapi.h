@@ -0,0 +1,47 @@
+/* Minimal RTAPI for running ethpwm.c as a plain process (loopback bench only).
+   Module parameters are registered by name and set with rtapi_shim_set_param()
+   before rtapi_app_main(), as loadrt would do. */
+#ifndef RTAPI_H
+#define RTAPI_H
+
+#define RTAPI_MSG_NONE  0
+#define RTAPI_MSG_ERR   1
+#define RTAPI_MSG_WARN  2
+#define RTAPI_MSG_INFO  3
+#define RTAPI_MSG_DBG   4
+#define RTAPI_MSG_ALL   5
+
+typedef unsigned int rtapi_u32;
+typedef int rtapi_s32;
+
+void rtapi_print_msg(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+int rtapi_get_msg_level(void);
+int rtapi_set_msg_level(int level);
+long long rtapi_get_time(void);
+
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_LICENSE(x)
+
+enum
+{
+    RTAPI_MP_TYPE_INT,
+    RTAPI_MP_TYPE_STRING,
+    RTAPI_MP_TYPE_ARRAY_INT,
+    RTAPI_MP_TYPE_ARRAY_STRING,
+};
+
+void rtapi_mp_register(const char* name, int type, void* addr, int count);
+/* Sets parameter from string, arrays are comma separated. Returns 0 on success */
+int rtapi_shim_set_param(const char* name, const char* value);
+
+#define RTAPI_MP_REG(var, type, addr, count) \
+    static void __attribute__((constructor)) rtapi_mp_reg_##var(void) \
+    { rtapi_mp_register(#var, type, (void*) (addr), count); }
+
+#define RTAPI_MP_INT(var, desc)                 RTAPI_MP_REG(var, RTAPI_MP_TYPE_INT, &var, 1)
+#define RTAPI_MP_STRING(var, desc)              RTAPI_MP_REG(var, RTAPI_MP_TYPE_STRING, &var, 1)
+#define RTAPI_MP_ARRAY_INT(var, num, desc)      RTAPI_MP_REG(var, RTAPI_MP_TYPE_ARRAY_INT, var, num)
+#define RTAPI_MP_ARRAY_STRING(var, num, desc)   RTAPI_MP_REG(var, RTAPI_MP_TYPE_ARRAY_STRING, var, num)
+
+#endif
@@ -0,0 +1,7 @@
+#ifndef RTAPI_APP_H
+#define RTAPI_APP_H
+
+int rtapi_app_main(void);
+void rtapi_app_exit(void);
+
+#endif
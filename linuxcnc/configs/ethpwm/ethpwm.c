@@ -1,9 +1,37 @@
+#ifdef __KERNEL__
 #include <linux/netdevice.h>
 #include <linux/skbuff.h>
+#include <linux/etherdevice.h>
+#include <linux/if_vlan.h>
+#include <linux/math64.h>
 #include <linux/workqueue.h>
+#else
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+#include <linux/types.h>
+#include <endian.h>
+#endif
 #include "rtapi.h"              /* RTAPI realtime OS API */
 #include "rtapi_app.h"          /* RTAPI realtime module decls */
 #include "hal.h"                /* HAL public API decls */
+#include "ethpwm_proto.h"       /* wire protocol */
+
+#define ETHPWM_MAX_CHANNELS     64
+#define ETHPWM_MAX_NODES        8
+#define ETHPWM_MAX_SAMPLES      64
+#define ETHPWM_MAX_STEPPERS     16
+#define ETHPWM_OUTPUT_PWM       0       /* output types of a channel */
+#define ETHPWM_OUTPUT_PWM_DIR   1
+#define ETHPWM_OUTPUT_PDM       2
 
 /* module information */
 MODULE_AUTHOR("Yuri Kobets");
@@ -12,11 +40,35 @@ MODULE_LICENSE("GPL");
 
 static int channels = 1;                    /* number of pwm generators configured */
 static char* iface = "eth0";                /* interface to use for sending packets */
-static char* dst = "ff:ff:ff:ff:ff:ff";     /* MAC address of destination device */
+static char* dst[ETHPWM_MAX_NODES] = {"ff:ff:ff:ff:ff:ff"};  /* MAC addresses of destination devices */
+static int node[ETHPWM_MAX_CHANNELS];       /* destination device of each channel */
+static int stream[ETHPWM_MAX_CHANNELS];     /* duty samples per servo period, 0 - single value */
+static int output_type[ETHPWM_MAX_CHANNELS];    /* output type of each channel */
+static int din[ETHPWM_MAX_NODES];           /* number of remote inputs of each device */
+static int dout[ETHPWM_MAX_NODES];          /* number of remote outputs of each device */
+static int ring_size = 16;                  /* number of preallocated transmit frames */
+static int proto = 1;                       /* protocol version of sent frames */
+static int vlan = -1;                       /* 802.1Q VLAN id of sent frames, -1 - untagged */
+static int pcp = 0;                         /* 802.1Q priority code point of tagged frames */
+static int tx_priority = 0;                 /* socket buffer priority of sent frames */
+static int steppers = 0;                    /* number of step generators on the devices */
+static int step_node[ETHPWM_MAX_STEPPERS];  /* destination device of each step generator */
 
 RTAPI_MP_INT(channels, "Number of channels channels");
 RTAPI_MP_STRING(iface, "Network interface name");
-RTAPI_MP_STRING(dst, "MAC address of destination PWM device");
+RTAPI_MP_ARRAY_STRING(dst, ETHPWM_MAX_NODES, "MAC addresses of destination PWM devices");
+RTAPI_MP_ARRAY_INT(node, ETHPWM_MAX_CHANNELS, "Index of destination device (in dst list) for each channel");
+RTAPI_MP_ARRAY_INT(stream, ETHPWM_MAX_CHANNELS, "Number of duty samples per servo period for each channel, 0 - no streaming");
+RTAPI_MP_ARRAY_INT(output_type, ETHPWM_MAX_CHANNELS, "Output type of each channel: 0 - PWM, 1 - PWM and direction, 2 - PDM");
+RTAPI_MP_ARRAY_INT(din, ETHPWM_MAX_NODES, "Number of remote digital inputs of each device");
+RTAPI_MP_ARRAY_INT(dout, ETHPWM_MAX_NODES, "Number of remote digital outputs of each device");
+RTAPI_MP_INT(ring_size, "Number of preallocated transmit frames (power of 2)");
+RTAPI_MP_INT(proto, "Protocol version: 1 - 16-bit values, 2 - 32-bit fixed point duty and frequency");
+RTAPI_MP_INT(vlan, "802.1Q VLAN id of sent frames, 0 - priority tag only, -1 - untagged");
+RTAPI_MP_INT(pcp, "802.1Q priority code point (0..7) of tagged frames");
+RTAPI_MP_INT(tx_priority, "Priority of sent frames, selects traffic class of mqprio/taprio");
+RTAPI_MP_INT(steppers, "Number of step generators on the devices");
+RTAPI_MP_ARRAY_INT(step_node, ETHPWM_MAX_STEPPERS, "Index of destination device (in dst list) for each step generator");
 
 
 /***********************************************************************
@@ -30,6 +82,10 @@ typedef struct
     hal_float_t *scale;        /* pin: scaling from value to duty cycle */
     hal_float_t *offset;    /* pin: offset: this is added to duty cycle */
     hal_float_t *pwm_freq;    /* pin: (max) output frequency in Hz */
+    hal_float_t **sample;       /* pins: command values of one period in streaming mode */
+    hal_float_t *deadband;      /* pin: value changes up to deadband are not sent */
+    hal_u32_t *min_interval;    /* pin: min ns between frames with this channel */
+    hal_u32_t *suppressed;      /* pin: number of periods with not sent changes */
 } ethpwm_t;
 
 typedef struct
@@ -39,24 +95,91 @@ typedef struct
     double scale;
     double offset;
     double pwm_freq;
+    __u32 sent_seq;         /* seq of the last frame with this channel */
+    long long sent_time;    /* time when the last frame was queued */
+    int acked;              /* last frame is acknowledged by receiver */
 } ethpwm_old_t;
 
-typedef struct __attribute__((packed))
+typedef struct
+{
+    hal_bit_t *enable;          /* pin: enable step generation */
+    hal_bit_t *control_type;    /* pin: 0 - follow position-cmd, 1 - follow velocity-cmd */
+    hal_float_t *position_cmd;  /* pin: commanded position, units */
+    hal_float_t *velocity_cmd;  /* pin: commanded velocity, units/s */
+    hal_float_t *position_scale;    /* pin: steps per unit */
+    hal_float_t *position_fb;   /* pin: position generated by the device, units */
+    hal_s32_t *counts;          /* pin: position generated by the device, steps */
+    hal_u32_t *steplen;         /* pin: step pulse length and min space between pulses, ns */
+    hal_u32_t *dirhold;         /* pin: min time from the last step to direction change, ns */
+    hal_u32_t *dirsetup;        /* pin: min time from direction change to the next step, ns */
+    hal_bit_t *fb_valid;        /* pin: position-fb is received within io-timeout */
+    long long fb_time;          /* time of the last received position */
+} ethpwm_step_t;
+
+typedef struct
+{
+    hal_u32_t *tx_frames;       /* pin: number of frames sent to the device */
+    hal_u32_t *tx_records;      /* pin: number of channel records sent to the device */
+    hal_u32_t *rx_acks;         /* pin: number of acks received from the device */
+    hal_u32_t *sync_rtt;        /* pin: round-trip time of the last clock sync, ns */
+    hal_s32_t *apply_jitter;    /* pin: last apply time error reported by the device, ns */
+    hal_u32_t *apply_jitter_max;    /* pin: max absolute apply time error, ns */
+    hal_u32_t *apply_late;      /* pin: number of frames received after their apply time */
+    hal_u32_t *stream_underruns;    /* pin: number of stream buffer underruns on the device */
+    hal_u32_t *stream_overruns;     /* pin: number of samples dropped on the device */
+    hal_bit_t **in;             /* pins: remote inputs */
+    hal_bit_t **out;            /* pins: remote outputs */
+    hal_bit_t *in_valid;        /* pin: inputs are received within io-timeout */
+    hal_u32_t *watchdog_timeouts;   /* pin: number of times the device went to safe state */
+} ethpwm_node_t;
+
+typedef struct
 {
-    __be32  seq;
-    __u8    channel;
-    __u8    enable;
-    __be16  value;
-    __be16  scale;
-    __be16  offset;
-    __be16  freq;
-} pwm_packet_t;
+    hal_u32_t *rtt_last;        /* pin: last round-trip time, ns */
+    hal_u32_t *rtt_max;         /* pin: max round-trip time, ns */
+    hal_u32_t *rtt_mean;        /* pin: mean round-trip time, ns */
+    hal_u32_t *retransmits;     /* pin: number of retransmitted channel records */
+    hal_u32_t *update_time;     /* pin: execution time of the last ethpwm.update call, ns */
+    hal_u32_t *update_time_max; /* pin: max execution time of ethpwm.update, ns */
+    hal_u32_t *frames_queued;   /* pin: number of frames queued for transmission */
+    hal_u32_t *frames_sent;     /* pin: number of frames passed to the driver */
+    hal_u32_t *alloc_fails;     /* pin: number of skb allocation failures */
+    hal_u32_t *header_fails;    /* pin: number of dev_hard_header failures or frames rejected by TX_RING */
+    hal_u32_t *ring_full;       /* pin: number of frames not queued because transmit ring is full */
+    hal_u32_t *ring_full_type[ETHPWM_FRAME_STEP + 1];   /* pins: ring_full by frame type */
+    hal_u32_t *backlog;         /* pin: number of queued frames not sent yet */
+    hal_u32_t *backlog_max;     /* pin: max backlog */
+    hal_bit_t *reset;           /* pin: reset statistics while true */
+    hal_u32_t retransmit_timeout;   /* param: ns to wait for ack, 0 - disable retransmit */
+    hal_u32_t apply_delay;      /* param: servo periods from sending to applying, 0 - apply on arrival */
+    hal_u32_t sync_interval;    /* param: ns between clock sync requests, 0 - disable sync */
+    hal_u32_t keepalive;        /* param: ns after which unchanged channel is sent again, 0 - never */
+    hal_u32_t io_timeout;       /* param: ns after which remote inputs are not valid */
+    hal_u32_t heartbeat;        /* param: ns between heartbeat frames, 0 - not sent */
+    hal_u32_t watchdog_timeout; /* param: ns without frames after which the device goes to safe state, 0 - never */
+} ethpwm_stat_t;
 
-struct pwm_work
+#define ETHPWM_MAX_FRAME        ETH_DATA_LEN
+#define ETHPWM_MAX_PAYLOAD      (ETHPWM_MAX_FRAME - sizeof(pwm_frame_hdr_t))
+#define ACK_RING_SIZE           64      /* power of 2 */
+#define TX_HISTORY_SIZE         64      /* power of 2 */
+
+#ifdef __KERNEL__
+/* Transmit slot. Frame is filled by update() and sent by tx_work */
+struct tx_slot
 {
-    struct work_struct 	work;
-	pwm_packet_t 		packet;
+    int                 node;       /* destination device */
+    unsigned int        len;        /* frame length */
+    pwm_frame_hdr_t     hdr;
+    __u8                payload[ETHPWM_MAX_PAYLOAD];
 };
+#else
+/* TX_RING frame data starts after tpacket2_hdr */
+#define TX_DATA_OFFSET          (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+#define TX_FRAME_SIZE           TPACKET_ALIGN(TX_DATA_OFFSET + ETHPWM_VLAN_ETH_HLEN + ETHPWM_MAX_FRAME)
+
+#define READ_ONCE(x)            (*(volatile __typeof__(x)*) &(x))
+#endif
 
 /* ptr to array of ethpwm_t structs in shared memory, 1 per channel */
 static ethpwm_t *ethpwm_array;
@@ -64,14 +187,115 @@ static ethpwm_t *ethpwm_array;
 /* ptr to array of ethpwm_old_t structs in shared memory, 1 per channel */
 static ethpwm_old_t *ethpwm_old;
 
-static unsigned char dst_addr[ETH_ALEN];
+/* ptr to ethpwm_stat_t struct in shared memory */
+static ethpwm_stat_t *ethpwm_stat;
+
+/* ptr to array of ethpwm_node_t structs in shared memory, 1 per destination device */
+static ethpwm_node_t *ethpwm_node;
+
+/* ptr to array of ethpwm_step_t structs in shared memory, 1 per step generator */
+static ethpwm_step_t *ethpwm_step;
+
+/* Received ack or sync reply, passed to process_ack() */
+typedef struct
+{
+    int         node;
+    __u8        type;
+    __u32       seq;
+    long long   time;
+    pwm_sync_t  sync;       /* ETHPWM_FRAME_SYNC only */
+    __u8        io_count;   /* ETHPWM_FRAME_IO only */
+    __u8        io[ETHPWM_IO_BYTES(ETHPWM_MAX_IO)];
+    pwm_heartbeat_t heartbeat;  /* ETHPWM_FRAME_HEARTBEAT only */
+    __u8        step_count; /* ETHPWM_FRAME_STEP_FB only */
+    pwm_step_fb_t step[ETHPWM_MAX_STEP];
+} ack_entry_t;
+
+/* Queue time of the recently sent frames, index is seq & (TX_HISTORY_SIZE - 1) */
+typedef struct
+{
+    __u32       seq;
+    int         valid;
+    long long   time;
+} tx_history_t;
+
+/* Destination device. Each device has own sequence of frames */
+typedef struct
+{
+    unsigned char   addr[ETH_ALEN];
+    __u32           seq_num;
+    tx_history_t    tx_history[TX_HISTORY_SIZE];
+    long long       clock_offset;   /* receiver clock - host clock, ns */
+    int             clock_valid;
+    long long       sync_rtt_min;   /* filter of sync samples */
+    long long       sync_time;      /* time of the last sync request */
+    __u32           sync_seq;
+    int             stream;         /* device has streaming channels */
+    __u32           io_seq;
+    long long       io_time;        /* time of the last received inputs */
+    __u32           hb_seq;
+    long long       hb_time;        /* time of the last heartbeat */
+    int             resend;         /* device went to safe state, send all channels again */
+    int             steppers;       /* device has step generators */
+    __u32           step_seq;
+} node_data_t;
+
+static node_data_t node_data[ETHPWM_MAX_NODES];
+static int num_nodes;
+/* channel number inside destination device, channels of each device are numbered from 0 */
+static __u8 remote_channel[ETHPWM_MAX_CHANNELS];
+/* step generator number inside destination device, numbered from 0 as channels */
+static __u8 remote_joint[ETHPWM_MAX_STEPPERS];
+/* frame types sent by update(), names of their ring-full pins */
+static const char* const frame_names[ETHPWM_FRAME_STEP + 1] =
+{
+    [ETHPWM_FRAME_PWM]          = "pwm",
+    [ETHPWM_FRAME_SYNC]         = "sync",
+    [ETHPWM_FRAME_STREAM]       = "stream",
+    [ETHPWM_FRAME_IO]           = "io",
+    [ETHPWM_FRAME_HEARTBEAT]    = "heartbeat",
+    [ETHPWM_FRAME_STEP]         = "step",
+};
 
 /* other globals */
 static int comp_id;        /* component ID */
+static unsigned int record_size;    /* size of one record for selected proto */
+static __u64 rtt_sum;
+static __u32 rtt_count;
+/* transmit counters, written by the transmit side only. Pins show difference from base */
+static unsigned int tx_sent, tx_sent_base;
+static unsigned int tx_alloc_fails, tx_alloc_fails_base;
+static unsigned int tx_header_fails, tx_header_fails_base;
+
+#ifdef __KERNEL__
 static struct net_device* eth_dev = NULL;
-static __u32 seq_num = 0;
 /* Workqueue for sending packets */
 static struct workqueue_struct* wq;
+static struct work_struct tx_work;
+
+/* Single producer (update) / single consumer (tx_work) ring of frames.
+   Head and tail are free running, slot index is counter & (ring_size - 1) */
+static struct tx_slot* tx_ring;
+static unsigned int tx_head;    /* written by update() only */
+static unsigned int tx_tail;    /* written by tx_work only */
+
+/* Ring of received acks. Producer is ack_rcv() (serialized by ack_lock),
+   consumer is update() */
+static ack_entry_t ack_ring[ACK_RING_SIZE];
+static unsigned int ack_head;
+static unsigned int ack_tail;
+static DEFINE_SPINLOCK(ack_lock);
+#else
+static int sock_fd = -1;
+static unsigned char src_addr[ETH_ALEN];
+static unsigned char* tx_ring;      /* mmap'd PACKET_TX_RING */
+static size_t tx_ring_len;
+static unsigned int tx_frames;      /* number of frames in TX_RING */
+static unsigned int tx_hlen;        /* ethernet header length, with 802.1Q tag if vlan is set */
+static unsigned int tx_head;        /* index of the next frame to fill */
+static unsigned int tx_done;        /* index of the oldest frame not reclaimed yet */
+static unsigned int tx_pending;     /* number of frames between tx_done and tx_head */
+#endif
 
 
 /***********************************************************************
@@ -79,7 +303,25 @@ static struct workqueue_struct* wq;
 ************************************************************************/
 
 static int export_ethpwm(int num, ethpwm_t * addr, ethpwm_old_t* old);
+static int export_stat(ethpwm_stat_t* addr);
+static int export_node(int num, ethpwm_node_t* addr);
+static int export_step(int num, ethpwm_step_t* addr);
+static int parse_nodes(void);
+static int node_frames(int n);
 static void update(void *arg, long period);
+static void process_ack(const ack_entry_t* ack);
+
+/* Network transport, kernel (skb) or uspace (PACKET_TX_RING) */
+static int open_transport(void);
+static void close_transport(void);
+/* Returns header of the next frame of type to device n or NULL if no frame is free */
+static pwm_frame_hdr_t* begin_frame(int n, __u8 type);
+/* Queues filled frame of len bytes for transmission */
+static void commit_frame(pwm_frame_hdr_t* hdr, unsigned int len);
+/* Passes acks received since the last call to process_ack() */
+static void receive_acks(void);
+/* Returns number of queued frames not sent yet */
+static unsigned int tx_backlog(void);
 
 /***********************************************************************
 *                       INIT AND EXIT CODE                             *
@@ -87,7 +329,7 @@ static void update(void *arg, long period);
 
 int rtapi_app_main(void)
 {
-    int n, retval;
+    int n, retval, frames;
 
     if (channels <= 0) 
     {
@@ -95,26 +337,63 @@ int rtapi_app_main(void)
             "ethpwm: ERROR: no channels configured\n");
         return -1;
     }
-
-    eth_dev = dev_get_by_name(&init_net, iface);
-    if(eth_dev == NULL)
+    if (channels > ETHPWM_MAX_CHANNELS) 
     {
-        rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: network device is not found\n");
+        rtapi_print_msg(RTAPI_MSG_ERR,
+            "ethpwm: ERROR: too many channels (max %d)\n", ETHPWM_MAX_CHANNELS);
         return -1;
     }
-	
-    /* Initialize workqueue */
-    wq = alloc_ordered_workqueue("ethpwm", WQ_HIGHPRI);
-    if(!wq)
+    if (steppers < 0 || steppers > ETHPWM_MAX_STEPPERS) 
+    {
+        rtapi_print_msg(RTAPI_MSG_ERR,
+            "ethpwm: ERROR: too many step generators (max %d)\n", ETHPWM_MAX_STEPPERS);
+        return -1;
+    }
+    if (ring_size < 2 || (ring_size & (ring_size - 1)) != 0) 
+    {
+        rtapi_print_msg(RTAPI_MSG_ERR,
+            "ethpwm: ERROR: ring_size must be a power of 2\n");
+        return -1;
+    }
+    if (vlan < -1 || vlan > ETHPWM_VLAN_MAX || pcp < 0 || pcp > ETHPWM_PCP_MAX) 
+    {
+        rtapi_print_msg(RTAPI_MSG_ERR,
+            "ethpwm: ERROR: vlan must be -1..%d and pcp 0..%d\n", ETHPWM_VLAN_MAX, ETHPWM_PCP_MAX);
+        return -1;
+    }
+    switch(proto)
+    {
+        case ETHPWM_VERSION:
+            record_size = sizeof(pwm_record_t);
+            break;
+        case ETHPWM_VERSION_32:
+            record_size = sizeof(pwm_record32_t);
+            break;
+        default:
+            rtapi_print_msg(RTAPI_MSG_ERR,
+                "ethpwm: ERROR: unsupported protocol version %d\n", proto);
+            return -1;
+    }
+
+    if(parse_nodes() != 0)
     {
-        printk(KERN_ERR "Impossible to create workqueue\n");
         return -1;
     }
+    /* frames of the previous period may still be in the ring */
+    frames = 0;
+    for(n = 0; n < num_nodes; n++)
+    {
+        frames += 2 * node_frames(n);
+    }
+    while(ring_size < frames)
+    {
+        ring_size <<= 1;
+    }
+    rtapi_print_msg(RTAPI_MSG_INFO, "ethpwm: %d transmit frames\n", ring_size);
 
-    if(sscanf(dst, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx%*c", &dst_addr[0], &dst_addr[1], &dst_addr[2], &dst_addr[3],
-            &dst_addr[4], &dst_addr[5]) != ETH_ALEN)
+    if(open_transport() != 0)
     {
-        rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: incorrect destrination address\n");
+        close_transport();
         return -1;
     }
 
@@ -123,6 +402,7 @@ int rtapi_app_main(void)
     if (comp_id < 0) 
     {
         rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: hal_init() failed\n");
+        close_transport();
         return -1;
     }
     /* allocate shared memory for generator data */
@@ -132,17 +412,85 @@ int rtapi_app_main(void)
         rtapi_print_msg(RTAPI_MSG_ERR,
             "ethpwm: ERROR: hal_malloc() failed\n");
         hal_exit(comp_id);
+        close_transport();
         return -1;
     }
     /* allocate shared memory for old data */
     ethpwm_old = hal_malloc(channels * sizeof(ethpwm_old_t));
-    if (ethpwm_array == 0) 
+    if (ethpwm_old == 0) 
+    {
+        rtapi_print_msg(RTAPI_MSG_ERR,
+            "ethpwm: ERROR: hal_malloc() failed\n");
+        hal_exit(comp_id);
+        close_transport();
+        return -1;
+    }
+    /* allocate shared memory for statistics */
+    ethpwm_stat = hal_malloc(sizeof(ethpwm_stat_t));
+    if (ethpwm_stat == 0) 
+    {
+        rtapi_print_msg(RTAPI_MSG_ERR,
+            "ethpwm: ERROR: hal_malloc() failed\n");
+        hal_exit(comp_id);
+        close_transport();
+        return -1;
+    }
+    retval = export_stat(ethpwm_stat);
+    if (retval != 0) 
+    {
+        rtapi_print_msg(RTAPI_MSG_ERR,
+            "ethpwm: ERROR: statistics var export failed\n");
+        hal_exit(comp_id);
+        close_transport();
+        return -1;
+    }
+    /* allocate shared memory for destination devices */
+    ethpwm_node = hal_malloc(num_nodes * sizeof(ethpwm_node_t));
+    if (ethpwm_node == 0) 
     {
         rtapi_print_msg(RTAPI_MSG_ERR,
             "ethpwm: ERROR: hal_malloc() failed\n");
         hal_exit(comp_id);
+        close_transport();
         return -1;
     }
+    for (n = 0; n < num_nodes; n++) 
+    {
+        retval = export_node(n, &(ethpwm_node[n]));
+        if (retval != 0) 
+        {
+            rtapi_print_msg(RTAPI_MSG_ERR,
+                "ethpwm: ERROR: node %d var export failed\n", n);
+            hal_exit(comp_id);
+            close_transport();
+            return -1;
+        }
+    }
+    /* allocate shared memory for step generators */
+    if (steppers > 0) 
+    {
+        ethpwm_step = hal_malloc(steppers * sizeof(ethpwm_step_t));
+        if (ethpwm_step == 0) 
+        {
+            rtapi_print_msg(RTAPI_MSG_ERR,
+                "ethpwm: ERROR: hal_malloc() failed\n");
+            hal_exit(comp_id);
+            close_transport();
+            return -1;
+        }
+    }
+    for (n = 0; n < steppers; n++) 
+    {
+        retval = export_step(n, &(ethpwm_step[n]));
+        if (retval != 0) 
+        {
+            rtapi_print_msg(RTAPI_MSG_ERR,
+                "ethpwm: ERROR: step generator %d var export failed\n", n);
+            hal_exit(comp_id);
+            close_transport();
+            return -1;
+        }
+    }
     /* export all the variables for each PWM generator */
     for (n = 0; n < channels; n++) 
     {
@@ -153,6 +501,7 @@ int rtapi_app_main(void)
             rtapi_print_msg(RTAPI_MSG_ERR,
                 "ethpwm: ERROR: ethpwm %d var export failed\n", n);
             hal_exit(comp_id);
+            close_transport();
             return -1;
         }
     }
@@ -164,176 +513,1736 @@ int rtapi_app_main(void)
         rtapi_print_msg(RTAPI_MSG_ERR,
             "ethpwm: ERROR: update funct export failed\n");
         hal_exit(comp_id);
+        close_transport();
         return -1;
     }
     rtapi_print_msg(RTAPI_MSG_INFO,
-        "ethpwm: installed %d PWM/PDM generators\n", channels);
+        "ethpwm: installed %d PWM/PDM generators and %d step generators on %d devices\n",
+        channels, steppers, num_nodes);
     hal_ready(comp_id);
     return 0;
 }
 
 void rtapi_app_exit(void)
 {
-    if(wq)
+    close_transport();
+    hal_exit(comp_id);
+}
+
+/* Returns destination device with address addr, broadcast destination matches any address */
+static int find_node(const unsigned char* addr)
+{
+    static const unsigned char bcast[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    int n;
+
+    for(n = 0; n < num_nodes; n++)
     {
-        flush_workqueue(wq);
-        destroy_workqueue(wq);
+        if(!memcmp(node_data[n].addr, addr, ETH_ALEN) || !memcmp(node_data[n].addr, bcast, ETH_ALEN))
+        {
+            return n;
+        }
     }
-    if(eth_dev)
+    return -1;
+}
+
+/* Returns length of the filled frame */
+static unsigned int frame_len(const pwm_frame_hdr_t* hdr)
+{
+    return (unsigned int) ethpwm_frame_len(hdr, ETHPWM_MAX_FRAME);
+}
+
+/* Returns 1 for frame types sent by the device */
+static int is_reply_type(__u8 type)
+{
+    return type == ETHPWM_FRAME_ACK || type == ETHPWM_FRAME_SYNC || type == ETHPWM_FRAME_IO ||
+           type == ETHPWM_FRAME_HEARTBEAT || type == ETHPWM_FRAME_STEP_FB;
+}
+
+/* Copies payload of frame sent by the device into ack */
+static void copy_reply_payload(ack_entry_t* ack, const pwm_frame_hdr_t* hdr)
+{
+    if(hdr->type == ETHPWM_FRAME_SYNC)
     {
-        dev_put(eth_dev);
-        eth_dev = NULL;
+        memcpy(&ack->sync, hdr + 1, sizeof(pwm_sync_t));
+    } else if(hdr->type == ETHPWM_FRAME_IO)
+    {
+        ack->io_count = hdr->count > ETHPWM_MAX_IO ? ETHPWM_MAX_IO : hdr->count;
+        memcpy(ack->io, hdr + 1, ETHPWM_IO_BYTES(ack->io_count));
+    } else if(hdr->type == ETHPWM_FRAME_HEARTBEAT)
+    {
+        memcpy(&ack->heartbeat, hdr + 1, sizeof(pwm_heartbeat_t));
+    } else if(hdr->type == ETHPWM_FRAME_STEP_FB)
+    {
+        ack->step_count = hdr->count > ETHPWM_MAX_STEP ? ETHPWM_MAX_STEP : hdr->count;
+        memcpy(ack->step, hdr + 1, ack->step_count * sizeof(pwm_step_fb_t));
     }
-    hal_exit(comp_id);
 }
 
+/* Returns the first record of the frame */
+static __u8* frame_records(pwm_frame_hdr_t* hdr)
+{
+    return (__u8*) hdr + ethpwm_records_offset(hdr);
+}
+
+/* Returns the max number of frames update() queues to device n in one period */
+static int node_frames(int n)
+{
+    /* PWM, heartbeat and sync frames, stream, I/O and step frames if they are used */
+    return 3 + node_data[n].stream + (din[n] || dout[n]) + (node_data[n].steppers != 0);
+}
+
+/* Counts a frame not queued because the transmit ring is full, its sender tries again in the next period */
+static void count_ring_full(__u8 type)
+{
+    (*ethpwm_stat->ring_full)++;
+    (*ethpwm_stat->ring_full_type[type])++;
+}
+
+#ifdef __KERNEL__
 /***********************************************************************
-*              REALTIME STEP PULSE GENERATION FUNCTIONS                *
+*                  KERNEL TRANSPORT (SKB AND WORKQUEUE)                *
 ************************************************************************/
 
-static void send_packet_work(struct work_struct *work)
+static int ack_rcv(struct sk_buff *skb, struct net_device *dev,
+                   struct packet_type *pt, struct net_device *orig_dev);
+static void send_packet_work(struct work_struct *work);
+
+static struct packet_type ack_packet_type __read_mostly = 
 {
-    struct pwm_work* data = (struct pwm_work*) work;
-    pwm_packet_t* packet;
-    struct sk_buff* skb = alloc_skb(ETH_HLEN + sizeof(pwm_packet_t), GFP_ATOMIC);
-    if(skb)
+    .type = cpu_to_be16(ETHPWM_ETHERTYPE),
+    .func = ack_rcv,
+};
+
+/* Allocates skb of one frame. A sent skb may still be held by a packet tap or
+   the qdisc after dev_queue_xmit(), so every frame gets a fresh one. It runs in
+   tx_work, update() itself does not allocate */
+static struct sk_buff* get_tx_skb(void)
+{
+    struct sk_buff* skb = alloc_skb(ETHPWM_VLAN_ETH_HLEN + ETHPWM_MAX_FRAME, GFP_KERNEL);
+
+    if(!skb)
     {
-        skb->dev = eth_dev;
-        skb->pkt_type = PACKET_OUTGOING;
-        skb_reserve(skb, ETH_HLEN);
-        skb_reset_network_header(skb);
+        return NULL;
+    }
+    skb->dev = eth_dev;
+    skb->protocol = htons(ETHPWM_ETHERTYPE);
+    skb->pkt_type = PACKET_OUTGOING;
+    skb->priority = tx_priority;
+    /* room for the tag, if the driver can't insert it, it is inserted in software */
+    skb_reserve(skb, ETHPWM_VLAN_ETH_HLEN);
+    skb_reset_network_header(skb);
+    if(vlan >= 0)
+    {
+        __vlan_hwaccel_put_tag(skb, htons(ETH_P_8021Q), ethpwm_vlan_tci(vlan, pcp));
+    }
+    return skb;
+}
 
-        packet = (pwm_packet_t*) skb_put(skb, sizeof(pwm_packet_t));
-        *packet = data->packet;
+static void send_slot(struct tx_slot* slot)
+{
+    unsigned int len = slot->len;
+    struct sk_buff* skb = get_tx_skb();
+    if(skb)
+    {
+        memcpy(skb_put(skb, len), &slot->hdr, len);
 
-        if(dev_hard_header(skb, eth_dev, 0xEAEB, dst_addr, eth_dev->dev_addr, eth_dev->addr_len) >= 0)
+        if(dev_hard_header(skb, eth_dev, ETHPWM_ETHERTYPE, node_data[slot->node].addr, eth_dev->dev_addr, eth_dev->addr_len) >= 0)
         {
             dev_queue_xmit(skb);
+            tx_sent++;
         } else
         {
-            printk(KERN_ERR "ethpwm: error dev_hard_header");
             kfree_skb(skb);
+            tx_header_fails++;
+            printk(KERN_ERR "ethpwm: error dev_hard_header");
         }
+    } else
+    {
+        tx_alloc_fails++;
+        printk(KERN_ERR "ethpwm: skb allocation is failed");
     }
-    kfree(work);
 }
 
-static void send_packet(int idx)
+static void send_packet_work(struct work_struct *work)
 {
-    struct pwm_work* work = (struct pwm_work*) kmalloc(sizeof(struct pwm_work), GFP_KERNEL);
-    if(work)
-    {
-        INIT_WORK((struct work_struct*) work, send_packet_work);
-
-        work->packet.channel = (__u8) idx;
-        work->packet.seq     = htonl((seq_num++));
-        work->packet.value   = htons((__u16) *(ethpwm_array[idx].value));
-        work->packet.scale   = htons((__u16) *ethpwm_array[idx].scale);
-        work->packet.offset  = htons((__u16) *ethpwm_array[idx].offset);
-        work->packet.freq    = htons((__u16) *ethpwm_array[idx].pwm_freq);
-        work->packet.enable  = *ethpwm_array[idx].enable;
+    unsigned int tail = tx_tail;
+    unsigned int head = smp_load_acquire(&tx_head);
 
-        queue_work(wq, (struct work_struct*) work);
-    } else
+    while(tail != head)
     {
-        printk(KERN_ERR "ethpwm: memory allocation for pwm work is failed");
+        send_slot(&tx_ring[tail & (ring_size - 1)]);
+        tail++;
+        /* release the slot to update() */
+        smp_store_release(&tx_tail, tail);
+        head = smp_load_acquire(&tx_head);
     }
 }
 
-static int is_channel_changed(int idx)
+static int alloc_tx_ring(void)
 {
-    if(ethpwm_old[idx].value != *ethpwm_array[idx].value ||
-       ethpwm_old[idx].scale != *ethpwm_array[idx].scale ||
-       ethpwm_old[idx].offset != *ethpwm_array[idx].offset ||
-       ethpwm_old[idx].pwm_freq != *ethpwm_array[idx].pwm_freq ||
-       ethpwm_old[idx].enable != *ethpwm_array[idx].enable)
-    {
-        ethpwm_old[idx].value = *ethpwm_array[idx].value;
-        ethpwm_old[idx].scale = *ethpwm_array[idx].scale;
-        ethpwm_old[idx].offset = *ethpwm_array[idx].offset;
-        ethpwm_old[idx].pwm_freq = *ethpwm_array[idx].pwm_freq;
-        ethpwm_old[idx].enable = *ethpwm_array[idx].enable;
+    int i;
 
-        return 1;
+    tx_ring = (struct tx_slot*) kcalloc(ring_size, sizeof(struct tx_slot), GFP_KERNEL);
+    if(!tx_ring)
+    {
+        return -1;
+    }
+    for(i = 0; i < ring_size; i++)
+    {
+        tx_ring[i].hdr.marker  = ETHPWM_EXT_MARKER;
+        tx_ring[i].hdr.version = (__u8) proto;
+        tx_ring[i].hdr.type    = ETHPWM_FRAME_PWM;
     }
+    tx_head = 0;
+    tx_tail = 0;
     return 0;
 }
 
-static void update(void *arg, long period)
+static void free_tx_ring(void)
 {
-    int i;
-    for(i = 0; i < channels; i++)
+    if(tx_ring)
     {
-        if(is_channel_changed(i))
-        {
-            send_packet(i);
-        }
+        kfree(tx_ring);
+        tx_ring = NULL;
     }
 }
 
+static int ack_rcv(struct sk_buff *skb, struct net_device *dev,
+                   struct packet_type *pt, struct net_device *orig_dev)
+{
+    const pwm_frame_hdr_t* hdr;
+    unsigned int head;
+    int n, len;
+    long long now = rtapi_get_time();
 
-/***********************************************************************
-*                   LOCAL FUNCTION DEFINITIONS                         *
-************************************************************************/
+    /* replies tagged with a VLAN id, which has no VLAN device here, arrive as PACKET_OTHERHOST */
+    if((skb->pkt_type == PACKET_OTHERHOST && (vlan < 0 || !ether_addr_equal(eth_hdr(skb)->h_dest, eth_dev->dev_addr))) ||
+       skb->pkt_type == PACKET_OUTGOING || !pskb_may_pull(skb, sizeof(pwm_frame_hdr_t)))
+    {
+        goto consumeskb;
+    }
+    hdr = (const pwm_frame_hdr_t*) skb_network_header(skb);
+    if(hdr->marker != ETHPWM_EXT_MARKER || !is_reply_type(hdr->type))
+    {
+        goto consumeskb;
+    }
+    len = ethpwm_frame_len(hdr, sizeof(pwm_frame_hdr_t));
+    if(len < 0 || !pskb_may_pull(skb, len))
+    {
+        goto consumeskb;
+    }
+    hdr = (const pwm_frame_hdr_t*) skb_network_header(skb);
+    n = find_node(eth_hdr(skb)->h_source);
+    if(n < 0)
+    {
+        goto consumeskb;
+    }
 
-static int export_ethpwm(int num, ethpwm_t * addr, ethpwm_old_t* old)
-{
-    int retval, msg;
+    spin_lock(&ack_lock);
+    head = ack_head;
+    if(head - smp_load_acquire(&ack_tail) < ACK_RING_SIZE)
+    {
+        ack_entry_t* ack = &ack_ring[head & (ACK_RING_SIZE - 1)];
 
-    /* This function exports a lot of stuff, which results in a lot of
-       logging if msg_level is at INFO or ALL. So we save the current value
-       of msg_level and restore it later.  If you actually need to log this
-       function's actions, change the second line below */
-    msg = rtapi_get_msg_level();
-    rtapi_set_msg_level(RTAPI_MSG_WARN);
+        ack->node = n;
+        ack->type = hdr->type;
+        ack->seq = ntohl(hdr->seq);
+        ack->time = now;
+        copy_reply_payload(ack, hdr);
+        smp_store_release(&ack_head, head + 1);
+    }
+    spin_unlock(&ack_lock);
 
-    /* export pins */
-    retval = hal_pin_float_newf(HAL_IO, &(addr->scale), comp_id,
-        "ethpwm.%d.scale", num);
-    if (retval != 0) 
+consumeskb:
+    consume_skb(skb);
+    return NET_RX_SUCCESS;
+}
+
+static int open_transport(void)
+{
+    eth_dev = dev_get_by_name(&init_net, iface);
+    if(eth_dev == NULL)
     {
-        return retval;
+        rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: network device is not found\n");
+        return -1;
+    }
+	
+    /* Initialize workqueue */
+    wq = alloc_ordered_workqueue("ethpwm", WQ_HIGHPRI);
+    if(!wq)
+    {
+        printk(KERN_ERR "Impossible to create workqueue\n");
+        return -1;
     }
 
-    retval = hal_pin_float_newf(HAL_IO, &(addr->offset), comp_id,
-        "ethpwm.%d.offset", num);
-    if (retval != 0) 
+    INIT_WORK(&tx_work, send_packet_work);
+    if(alloc_tx_ring() != 0)
     {
-        return retval;
+        rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: transmit ring allocation failed\n");
+        return -1;
     }
 
-    retval = hal_pin_float_newf(HAL_IO, &(addr->pwm_freq), comp_id,
-        "ethpwm.%d.pwm-freq", num);
-    if (retval != 0) 
+    /* receive acks from PWM device */
+    ack_packet_type.dev = eth_dev;
+    dev_add_pack(&ack_packet_type);
+    return 0;
+}
+
+static void close_transport(void)
+{
+    if(ack_packet_type.dev)
     {
-        return retval;
+        dev_remove_pack(&ack_packet_type);
+        ack_packet_type.dev = NULL;
     }
-    retval = hal_pin_bit_newf(HAL_IN, &(addr->enable), comp_id,
-        "ethpwm.%d.enable", num);
-    if (retval != 0) 
+    if(wq)
     {
-        return retval;
+        flush_workqueue(wq);
+        destroy_workqueue(wq);
+        wq = NULL;
     }
-    retval = hal_pin_float_newf(HAL_IN, &(addr->value), comp_id,
-        "ethpwm.%d.value", num);
-    if (retval != 0) 
+    free_tx_ring();
+    if(eth_dev)
     {
-        return retval;
+        dev_put(eth_dev);
+        eth_dev = NULL;
     }
-    /* set default pin values */
-    *(addr->enable) = 0;
-    *(addr->value) = 0.0;
-    *(addr->scale) = 1.0;
-    *(addr->offset) = 0.0;
-    *(addr->pwm_freq) = 0;
-    /* init old values */
-    old->enable = *(addr->enable) + 1;
-    old->value = *(addr->value) + 1.0;
-    old->scale = *(addr->scale) + 1.0;
-    old->offset = *(addr->offset) + 1.0;
-    old->pwm_freq = *(addr->pwm_freq) + 1.0;
-    /* restore saved message level */
-    rtapi_set_msg_level(msg);
-    return 0;
 }
 
+static pwm_frame_hdr_t* begin_frame(int n, __u8 type)
+{
+    struct tx_slot* slot;
+
+    if(tx_head - smp_load_acquire(&tx_tail) >= (unsigned int) ring_size)
+    {
+        count_ring_full(type);
+        return NULL;
+    }
+    slot = &tx_ring[tx_head & (ring_size - 1)];
+    slot->node = n;
+    return &slot->hdr;
+}
+
+static void commit_frame(pwm_frame_hdr_t* hdr, unsigned int len)
+{
+    container_of(hdr, struct tx_slot, hdr)->len = len;
+    /* publish the slot to tx_work */
+    smp_store_release(&tx_head, tx_head + 1);
+    queue_work(wq, &tx_work);
+    (*ethpwm_stat->frames_queued)++;
+}
+
+static unsigned int tx_backlog(void)
+{
+    return tx_head - smp_load_acquire(&tx_tail);
+}
+
+static void receive_acks(void)
+{
+    unsigned int tail = ack_tail;
+    unsigned int head = smp_load_acquire(&ack_head);
+
+    while(tail != head)
+    {
+        process_ack(&ack_ring[tail & (ACK_RING_SIZE - 1)]);
+        tail++;
+    }
+    smp_store_release(&ack_tail, tail);
+}
+
+#else
+/***********************************************************************
+*               USPACE TRANSPORT (AF_PACKET, PACKET_TX_RING)           *
+************************************************************************/
+
+static int open_transport(void)
+{
+    struct ifreq ifr;
+    struct sockaddr_ll addr;
+    struct tpacket_req req;
+    int val;
+    unsigned int i;
+
+    sock_fd = socket(AF_PACKET, SOCK_RAW, htons(ETHPWM_ETHERTYPE));
+    if(sock_fd < 0)
+    {
+        rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: can't open packet socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, iface, IFNAMSIZ - 1);
+    if(ioctl(sock_fd, SIOCGIFHWADDR, &ifr) < 0)
+    {
+        rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: network device is not found\n");
+        return -1;
+    }
+    memcpy(src_addr, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+    val = TPACKET_V2;
+    if(setsockopt(sock_fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val)) < 0)
+    {
+        rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: PACKET_VERSION: %s\n", strerror(errno));
+        return -1;
+    }
+    /* with mqprio/taprio the priority selects traffic class and TX queue */
+    if(setsockopt(sock_fd, SOL_SOCKET, SO_PRIORITY, &tx_priority, sizeof(tx_priority)) < 0)
+    {
+        rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: SO_PRIORITY: %s\n", strerror(errno));
+        return -1;
+    }
+    /* frames go straight to the driver, ethpwm.update is the only sender */
+    val = 1;
+    if(setsockopt(sock_fd, SOL_PACKET, PACKET_QDISC_BYPASS, &val, sizeof(val)) < 0)
+    {
+        rtapi_print_msg(RTAPI_MSG_WARN, "ethpwm: PACKET_QDISC_BYPASS is not supported\n");
+    }
+
+    /* one block with at least ring_size frames */
+    memset(&req, 0, sizeof(req));
+    req.tp_frame_size = TX_FRAME_SIZE;
+    req.tp_block_size = getpagesize();
+    while(req.tp_block_size < TX_FRAME_SIZE * ring_size)
+    {
+        req.tp_block_size <<= 1;
+    }
+    req.tp_block_nr = 1;
+    req.tp_frame_nr = req.tp_block_size / req.tp_frame_size;
+    if(setsockopt(sock_fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0)
+    {
+        rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: PACKET_TX_RING: %s\n", strerror(errno));
+        return -1;
+    }
+    tx_ring_len = req.tp_block_size * req.tp_block_nr;
+    tx_frames = req.tp_frame_nr;
+    tx_ring = mmap(NULL, tx_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, sock_fd, 0);
+    if(tx_ring == MAP_FAILED)
+    {
+        tx_ring = NULL;
+        rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: TX_RING mmap: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family   = AF_PACKET;
+    addr.sll_protocol = htons(ETHPWM_ETHERTYPE);
+    addr.sll_ifindex  = if_nametoindex(iface);
+    if(bind(sock_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+    {
+        rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: bind: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* ethernet and frame headers are constant except destination, prebuild them in all frames */
+    tx_hlen = vlan >= 0 ? ETHPWM_VLAN_ETH_HLEN : ETH_HLEN;
+    for(i = 0; i < tx_frames; i++)
+    {
+        unsigned char* data = tx_ring + i * TX_FRAME_SIZE + TX_DATA_OFFSET;
+        struct ether_header* eh = (struct ether_header*) data;
+        pwm_frame_hdr_t* hdr = (pwm_frame_hdr_t*) (data + tx_hlen);
+        __be16* tag = (__be16*) (data + 2 * ETH_ALEN);
+
+        memcpy(eh->ether_shost, src_addr, ETH_ALEN);
+        if(vlan >= 0)
+        {
+            /* 802.1Q tag goes between source address and ethertype */
+            *tag++ = htons(ETH_P_8021Q);
+            *tag++ = htons(ethpwm_vlan_tci(vlan, pcp));
+        }
+        *tag = htons(ETHPWM_ETHERTYPE);
+        hdr->marker  = ETHPWM_EXT_MARKER;
+        hdr->version = (__u8) proto;
+        hdr->type    = ETHPWM_FRAME_PWM;
+    }
+    tx_head = 0;
+    tx_done = 0;
+    tx_pending = 0;
+    return 0;
+}
+
+static void close_transport(void)
+{
+    if(tx_ring)
+    {
+        munmap(tx_ring, tx_ring_len);
+        tx_ring = NULL;
+    }
+    if(sock_fd >= 0)
+    {
+        close(sock_fd);
+        sock_fd = -1;
+    }
+}
+
+static struct tpacket2_hdr* tx_frame(unsigned int idx)
+{
+    return (struct tpacket2_hdr*) (tx_ring + idx * TX_FRAME_SIZE);
+}
+
+static pwm_frame_hdr_t* begin_frame(int n, __u8 type)
+{
+    struct tpacket2_hdr* frame = tx_frame(tx_head);
+    unsigned char* data = (unsigned char*) frame + TX_DATA_OFFSET;
+
+    /* a sent frame must be reclaimed before it is reused, so tx_pending stays within the ring */
+    if((tx_pending >= tx_frames && tx_backlog() >= tx_frames) ||
+       (__atomic_load_n(&frame->tp_status, __ATOMIC_ACQUIRE) & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)))
+    {
+        /* kernel did not send this frame yet, ring is full */
+        count_ring_full(type);
+        return NULL;
+    }
+    memcpy(((struct ether_header*) data)->ether_dhost, node_data[n].addr, ETH_ALEN);
+    return (pwm_frame_hdr_t*) (data + tx_hlen);
+}
+
+static void commit_frame(pwm_frame_hdr_t* hdr, unsigned int len)
+{
+    struct tpacket2_hdr* frame = tx_frame(tx_head);
+
+    frame->tp_len = tx_hlen + len;
+    __atomic_store_n(&frame->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    tx_head = (tx_head + 1) % tx_frames;
+    tx_pending++;
+    (*ethpwm_stat->frames_queued)++;
+    /* kick transmission, with PACKET_QDISC_BYPASS frame is passed to the driver here */
+    if(send(sock_fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != ENOBUFS)
+    {
+        rtapi_print_msg(RTAPI_MSG_DBG, "ethpwm: send failed: %d\n", errno);
+    }
+}
+
+/* Reclaims frames which kernel has processed */
+static unsigned int tx_backlog(void)
+{
+    struct tpacket2_hdr* frame;
+    unsigned int status;
+
+    while(tx_pending)
+    {
+        frame = tx_frame(tx_done);
+        status = __atomic_load_n(&frame->tp_status, __ATOMIC_ACQUIRE);
+        if(status & (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING))
+        {
+            break;
+        }
+        if(status & TP_STATUS_WRONG_FORMAT)
+        {
+            tx_header_fails++;
+        } else
+        {
+            tx_sent++;
+        }
+        tx_done = (tx_done + 1) % tx_frames;
+        tx_pending--;
+    }
+    return tx_pending;
+}
+
+static void receive_acks(void)
+{
+    unsigned char buf[ETH_HLEN + sizeof(pwm_frame_hdr_t) + ETHPWM_MAX_STEP * sizeof(pwm_step_fb_t)];
+    struct sockaddr_ll from;
+    socklen_t from_len;
+    const struct ether_header* eh = (const struct ether_header*) buf;
+    const pwm_frame_hdr_t* hdr = (const pwm_frame_hdr_t*) (buf + ETH_HLEN);
+    ack_entry_t ack = {0};
+    ssize_t len;
+    int n, needed;
+
+    for(;;)
+    {
+        from_len = sizeof(from);
+        len = recvfrom(sock_fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr*) &from, &from_len);
+        if(len < 0)
+        {
+            break;
+        }
+        /* replies tagged with a VLAN id, which has no VLAN device here, arrive as PACKET_OTHERHOST */
+        if(from.sll_pkttype == PACKET_OUTGOING ||
+           (from.sll_pkttype == PACKET_OTHERHOST && (vlan < 0 || memcmp(eh->ether_dhost, src_addr, ETH_ALEN) != 0)) ||
+           len < (ssize_t) (ETH_HLEN + sizeof(pwm_frame_hdr_t)))
+        {
+            continue;
+        }
+        if(hdr->marker != ETHPWM_EXT_MARKER || !is_reply_type(hdr->type))
+        {
+            continue;
+        }
+        needed = ethpwm_frame_len(hdr, len - ETH_HLEN);
+        if(needed < 0 || len < ETH_HLEN + needed)
+        {
+            continue;
+        }
+        n = find_node(eh->ether_shost);
+        if(n < 0)
+        {
+            continue;
+        }
+        /* ack time is the time of this update() call, RTT resolution is one period */
+        ack.node = n;
+        ack.type = hdr->type;
+        ack.seq = ntohl(hdr->seq);
+        ack.time = rtapi_get_time();
+        copy_reply_payload(&ack, hdr);
+        process_ack(&ack);
+    }
+}
+#endif
+
+/***********************************************************************
+*              REALTIME STEP PULSE GENERATION FUNCTIONS                *
+************************************************************************/
+
+static void add_record16(void* buf, int idx)
+{
+    pwm_record_t* rec = (pwm_record_t*) buf;
+
+    ethpwm_encode_record16(rec, remote_channel[idx], *ethpwm_array[idx].enable,
+                           (__u16) *ethpwm_array[idx].value, (__u16) *ethpwm_array[idx].scale,
+                           (__u16) *ethpwm_array[idx].offset, (__u16) *ethpwm_array[idx].pwm_freq);
+}
+
+/* Returns duty cycle value / scale + offset of channel idx in Q1.31 and its output
+   flags. With PWM and direction output negative duty sets the direction flag */
+static __u32 calc_duty(int idx, double value, __u8* flags)
+{
+    double duty = 0.0;
+
+    if(*ethpwm_array[idx].scale != 0.0)
+    {
+        duty = value / *ethpwm_array[idx].scale;
+    }
+    duty += *ethpwm_array[idx].offset;
+    *flags = output_type[idx] == ETHPWM_OUTPUT_PDM ? ETHPWM_FLAG_PDM : 0;
+    if(output_type[idx] == ETHPWM_OUTPUT_PWM_DIR && duty < 0.0)
+    {
+        duty = -duty;
+        *flags |= ETHPWM_FLAG_DIR;
+    }
+    if(duty < 0.0) duty = 0.0;
+    if(duty > 1.0) duty = 1.0;
+    return (__u32) (duty * ETHPWM_DUTY_ONE);
+}
+
+/* Returns frequency of channel idx in Q24.8 Hz */
+static __u32 calc_freq(int idx)
+{
+    double freq = *ethpwm_array[idx].pwm_freq;
+
+    if(freq < 0.0) freq = 0.0;
+    if(freq > (double) (0xFFFFFFFFu >> ETHPWM_FREQ_SHIFT)) freq = (double) (0xFFFFFFFFu >> ETHPWM_FREQ_SHIFT);
+    return (__u32) (freq * (1 << ETHPWM_FREQ_SHIFT));
+}
+
+static void add_record32(void* buf, int idx)
+{
+    ethpwm_state_t st;
+
+    st.channel = remote_channel[idx];
+    st.enable  = *ethpwm_array[idx].enable;
+    st.duty    = calc_duty(idx, *ethpwm_array[idx].value, &st.flags);
+    st.freq    = calc_freq(idx);
+    ethpwm_encode_record32((pwm_record32_t*) buf, &st);
+}
+
+static void add_channel(pwm_frame_hdr_t* hdr, int idx)
+{
+    void* rec = frame_records(hdr) + hdr->count * record_size;
+
+    if(proto == ETHPWM_VERSION_32)
+    {
+        add_record32(rec, idx);
+    } else
+    {
+        add_record16(rec, idx);
+    }
+    hdr->count++;
+}
+
+static void send_packet(int n, pwm_frame_hdr_t* hdr, unsigned int len, long long now)
+{
+    node_data_t* nd = &node_data[n];
+    tx_history_t* hist = &nd->tx_history[nd->seq_num & (TX_HISTORY_SIZE - 1)];
+
+    hist->seq = nd->seq_num;
+    hist->time = now;
+    hist->valid = 1;
+    /* all channels of the device changed in this period share one frame and one seq */
+    hdr->seq = htonl((nd->seq_num++));
+    commit_frame(hdr, len);
+    (*ethpwm_node[n].tx_frames)++;
+    *ethpwm_node[n].tx_records += hdr->count;
+}
+
+/* Returns 1 if channel must be sent. Value changes within deadband of the last
+   sent value and changes earlier than min-interval after the last frame are
+   suppressed. Enable change is always sent at once. save_channel() keeps the
+   sent state once the channel is in a frame. */
+static int is_channel_changed(int idx, long long now)
+{
+    double delta = *ethpwm_array[idx].value - ethpwm_old[idx].value;
+
+    if(delta < 0.0)
+    {
+        delta = -delta;
+    }
+    if(ethpwm_old[idx].enable == *ethpwm_array[idx].enable)
+    {
+        if(ethpwm_old[idx].scale == *ethpwm_array[idx].scale &&
+           ethpwm_old[idx].offset == *ethpwm_array[idx].offset &&
+           ethpwm_old[idx].pwm_freq == *ethpwm_array[idx].pwm_freq &&
+           delta <= *ethpwm_array[idx].deadband)
+        {
+            if(delta != 0.0)
+            {
+                (*ethpwm_array[idx].suppressed)++;
+            }
+            return 0;
+        }
+        if(*ethpwm_array[idx].min_interval &&
+           now - ethpwm_old[idx].sent_time < *ethpwm_array[idx].min_interval)
+        {
+            (*ethpwm_array[idx].suppressed)++;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Keeps the state of a sent channel for is_channel_changed() */
+static void save_channel(int idx)
+{
+    ethpwm_old[idx].value = *ethpwm_array[idx].value;
+    ethpwm_old[idx].scale = *ethpwm_array[idx].scale;
+    ethpwm_old[idx].offset = *ethpwm_array[idx].offset;
+    ethpwm_old[idx].pwm_freq = *ethpwm_array[idx].pwm_freq;
+    ethpwm_old[idx].enable = *ethpwm_array[idx].enable;
+}
+
+/* Updates clock offset of the device from sync reply (NTP-like, t4 is the reply time) */
+static void process_sync(const ack_entry_t* ack)
+{
+    node_data_t* nd = &node_data[ack->node];
+    ethpwm_node_t* pins = &ethpwm_node[ack->node];
+    long long t1 = (long long) ethpwm_be64_to_cpu(ack->sync.t1);
+    long long t2 = (long long) ethpwm_be64_to_cpu(ack->sync.t2);
+    long long t3 = (long long) ethpwm_be64_to_cpu(ack->sync.t3);
+    long long rtt = (ack->time - t1) - (t3 - t2);
+    long long offset = ((t2 - t1) + (t3 - ack->time)) / 2;
+
+    *pins->apply_jitter = (__s32) ntohl(ack->sync.jitter_last);
+    *pins->apply_jitter_max = ntohl(ack->sync.jitter_max);
+    *pins->apply_late = ntohl(ack->sync.late);
+    *pins->stream_underruns = ntohl(ack->sync.stream_underrun);
+    *pins->stream_overruns = ntohl(ack->sync.stream_overrun);
+    if(rtt < 0)
+    {
+        return;
+    }
+    *pins->sync_rtt = (__u32) rtt;
+    /* delayed samples give wrong offset, use only ones close to the best rtt.
+       The best rtt slowly grows to follow changes of the path. */
+    if(!nd->clock_valid || rtt <= nd->sync_rtt_min)
+    {
+        nd->sync_rtt_min = rtt;
+    } else
+    {
+        nd->sync_rtt_min += (nd->sync_rtt_min >> 4) + 1;
+        if(rtt > nd->sync_rtt_min + (nd->sync_rtt_min >> 1))
+        {
+            return;
+        }
+    }
+    if(nd->clock_valid)
+    {
+        nd->clock_offset += (offset - nd->clock_offset) / 4;
+    } else
+    {
+        nd->clock_offset = offset;
+        nd->clock_valid = 1;
+    }
+}
+
+/* Sets remote input pins from device reply */
+static void process_io(const ack_entry_t* ack)
+{
+    int i;
+    ethpwm_node_t* pins = &ethpwm_node[ack->node];
+
+    for(i = 0; i < din[ack->node] && i < ack->io_count; i++)
+    {
+        *pins->in[i] = (ack->io[i / 8] >> (i % 8)) & 1;
+    }
+    node_data[ack->node].io_time = ack->time;
+}
+
+/* Device turned its outputs off after watchdog timeout, its state must be sent again */
+static void process_heartbeat(const ack_entry_t* ack)
+{
+    __u32 timeouts = ntohl(ack->heartbeat.timeouts);
+    ethpwm_node_t* pins = &ethpwm_node[ack->node];
+
+    if(timeouts != *pins->watchdog_timeouts)
+    {
+        node_data[ack->node].resend = 1;
+    }
+    *pins->watchdog_timeouts = timeouts;
+}
+
+/* Sets position feedback pins of step generators from device reply */
+static void process_step_fb(const ack_entry_t* ack)
+{
+    int i, j;
+    ethpwm_step_t* sg;
+
+    for(i = 0; i < ack->step_count; i++)
+    {
+        for(j = 0; j < steppers; j++)
+        {
+            if(step_node[j] != ack->node || remote_joint[j] != ack->step[i].joint)
+            {
+                continue;
+            }
+            sg = &ethpwm_step[j];
+            *sg->counts = (hal_s32_t) ntohl(ack->step[i].position);
+            if(*sg->position_scale != 0.0)
+            {
+                *sg->position_fb = *sg->counts / *sg->position_scale;
+            }
+            sg->fb_time = ack->time;
+        }
+    }
+}
+
+static void process_ack(const ack_entry_t* ack)
+{
+    int i;
+    __u32 rtt;
+    tx_history_t* hist = &node_data[ack->node].tx_history[ack->seq & (TX_HISTORY_SIZE - 1)];
+
+    if(ack->type == ETHPWM_FRAME_SYNC)
+    {
+        process_sync(ack);
+        return;
+    }
+    if(ack->type == ETHPWM_FRAME_IO)
+    {
+        process_io(ack);
+        return;
+    }
+    if(ack->type == ETHPWM_FRAME_HEARTBEAT)
+    {
+        process_heartbeat(ack);
+        return;
+    }
+    if(ack->type == ETHPWM_FRAME_STEP_FB)
+    {
+        process_step_fb(ack);
+        return;
+    }
+    (*ethpwm_node[ack->node].rx_acks)++;
+    if(hist->valid && hist->seq == ack->seq)
+    {
+        hist->valid = 0;
+        rtt = (__u32) (ack->time - hist->time);
+        rtt_sum += rtt;
+        rtt_count++;
+        *ethpwm_stat->rtt_last = rtt;
+        if(rtt > *ethpwm_stat->rtt_max)
+        {
+            *ethpwm_stat->rtt_max = rtt;
+        }
+        *ethpwm_stat->rtt_mean = (__u32) ethpwm_div_u64(rtt_sum, rtt_count);
+    }
+    for(i = 0; i < channels; i++)
+    {
+        if(node[i] == ack->node && ethpwm_old[i].sent_seq == ack->seq)
+        {
+            ethpwm_old[i].acked = 1;
+        }
+    }
+}
+
+static int is_retransmit_needed(int idx, long long now)
+{
+    return ethpwm_stat->retransmit_timeout && !ethpwm_old[idx].acked &&
+           now - ethpwm_old[idx].sent_time >= ethpwm_stat->retransmit_timeout;
+}
+
+static int is_keepalive_needed(int idx, long long now)
+{
+    return ethpwm_stat->keepalive && now - ethpwm_old[idx].sent_time >= ethpwm_stat->keepalive;
+}
+
+/* Sends clock sync request to device n every sync-interval */
+static void send_sync(int n, long long now)
+{
+    node_data_t* nd = &node_data[n];
+    pwm_frame_hdr_t* hdr;
+    pwm_sync_t* sync;
+
+    if(!ethpwm_stat->sync_interval || (nd->sync_time && now - nd->sync_time < ethpwm_stat->sync_interval))
+    {
+        return;
+    }
+    hdr = begin_frame(n, ETHPWM_FRAME_SYNC);
+    if(!hdr)
+    {
+        /* sync_time is not updated, so the request is sent in the next period */
+        return;
+    }
+    hdr->type = ETHPWM_FRAME_SYNC;
+    hdr->count = 0;
+    hdr->seq = htonl(nd->sync_seq++);
+    sync = (pwm_sync_t*) (hdr + 1);
+    memset(sync, 0, sizeof(pwm_sync_t));
+    sync->t1 = ethpwm_cpu_to_be64((__u64) rtapi_get_time());
+    commit_frame(hdr, frame_len(hdr));
+    nd->sync_time = now;
+}
+
+/* Tells device n that the host is alive and sets its watchdog timeout */
+static void send_heartbeat(int n, long long now)
+{
+    node_data_t* nd = &node_data[n];
+    pwm_frame_hdr_t* hdr;
+    pwm_heartbeat_t* hb;
+
+    if(!ethpwm_stat->heartbeat || (nd->hb_time && now - nd->hb_time < ethpwm_stat->heartbeat))
+    {
+        return;
+    }
+    hdr = begin_frame(n, ETHPWM_FRAME_HEARTBEAT);
+    if(!hdr)
+    {
+        /* hb_time is not updated, so the heartbeat is sent in the next period */
+        return;
+    }
+    hdr->type = ETHPWM_FRAME_HEARTBEAT;
+    hdr->count = 0;
+    hdr->seq = htonl(nd->hb_seq++);
+    hb = (pwm_heartbeat_t*) (hdr + 1);
+    hb->timeout = htonl(ethpwm_stat->watchdog_timeout);
+    hb->timeouts = 0;
+    commit_frame(hdr, frame_len(hdr));
+    nd->hb_time = now;
+}
+
+/* Sends remote outputs of device n every period, device answers with its inputs */
+static void send_io(int n, long long now)
+{
+    node_data_t* nd = &node_data[n];
+    ethpwm_node_t* pins = &ethpwm_node[n];
+    pwm_frame_hdr_t* hdr;
+    __u8* bits;
+    int i;
+
+    if(!din[n] && !dout[n])
+    {
+        return;
+    }
+    *pins->in_valid = nd->io_time && now - nd->io_time < ethpwm_stat->io_timeout;
+    hdr = begin_frame(n, ETHPWM_FRAME_IO);
+    if(!hdr)
+    {
+        return;
+    }
+    hdr->type = ETHPWM_FRAME_IO;
+    hdr->count = (__u8) dout[n];
+    hdr->seq = htonl(nd->io_seq++);
+    bits = (__u8*) (hdr + 1);
+    memset(bits, 0, ETHPWM_IO_BYTES(dout[n]));
+    for(i = 0; i < dout[n]; i++)
+    {
+        if(*pins->out[i])
+        {
+            bits[i / 8] |= 1 << (i % 8);
+        }
+    }
+    commit_frame(hdr, frame_len(hdr));
+}
+
+/* Returns step target of step generator idx in Q48.16 steps or steps/s */
+static __s64 calc_step_target(int idx)
+{
+    ethpwm_step_t* sg = &ethpwm_step[idx];
+    double steps = *sg->control_type ? *sg->velocity_cmd : *sg->position_cmd;
+    /* keeps the target and the device arithmetic far from 64-bit overflow */
+    const double limit = (double) (1LL << 46);
+
+    steps *= *sg->position_scale;
+    if(steps > limit) steps = limit;
+    if(steps < -limit) steps = -limit;
+    return (__s64) (steps * (1 << ETHPWM_STEP_SHIFT));
+}
+
+/* Sends targets of all step generators of device n every period, device answers with generated positions */
+static void send_step(int n, long long now, long period)
+{
+    node_data_t* nd = &node_data[n];
+    pwm_frame_hdr_t* hdr;
+    pwm_step_t* rec;
+    ethpwm_step_t* sg;
+    int i;
+
+    if(!nd->steppers)
+    {
+        return;
+    }
+    hdr = begin_frame(n, ETHPWM_FRAME_STEP);
+    if(!hdr)
+    {
+        return;
+    }
+    hdr->type = ETHPWM_FRAME_STEP;
+    hdr->count = 0;
+    hdr->seq = htonl(nd->step_seq++);
+    rec = (pwm_step_t*) (hdr + 1);
+    for(i = 0; i < steppers; i++)
+    {
+        if(step_node[i] != n)
+        {
+            continue;
+        }
+        sg = &ethpwm_step[i];
+        *sg->fb_valid = sg->fb_time && now - sg->fb_time < ethpwm_stat->io_timeout;
+        rec->joint = remote_joint[i];
+        rec->enable = *sg->enable;
+        rec->mode = *sg->control_type ? ETHPWM_STEP_VELOCITY : ETHPWM_STEP_POSITION;
+        rec->reserved = 0;
+        rec->period = htonl((__u32) period);
+        rec->step_len = htonl(*sg->steplen);
+        rec->dir_hold = htonl(*sg->dirhold);
+        rec->dir_setup = htonl(*sg->dirsetup);
+        rec->target = ethpwm_cpu_to_be64((__u64) calc_step_target(i));
+        rec++;
+        hdr->count++;
+    }
+    commit_frame(hdr, frame_len(hdr));
+}
+
+/* Sends changed channels of device n in one frame */
+/* Why update_node() sends a channel */
+enum
+{
+    SEND_NONE,
+    SEND_CHANGED,       /* state changed */
+    SEND_RETRANSMIT,    /* not acked in retransmit-timeout */
+    SEND_REFRESH,       /* resend after a watchdog timeout of the device or keepalive */
+};
+
+static void update_node(int n, long long now, long period)
+{
+    int i, count = 0;
+    node_data_t* nd = &node_data[n];
+    pwm_frame_hdr_t* hdr;
+    __u8 send[ETHPWM_MAX_CHANNELS];
+
+    /* a ring slot is taken only if some channel is sent */
+    for(i = 0; i < channels; i++)
+    {
+        send[i] = SEND_NONE;
+        if(node[i] != n || stream[i])
+        {
+            continue;
+        }
+        if(is_channel_changed(i, now))
+        {
+            send[i] = SEND_CHANGED;
+        } else if(is_retransmit_needed(i, now))
+        {
+            send[i] = SEND_RETRANSMIT;
+        } else if(nd->resend || is_keepalive_needed(i, now))
+        {
+            send[i] = SEND_REFRESH;
+        } else
+        {
+            continue;
+        }
+        count++;
+    }
+    if(!count)
+    {
+        nd->resend = 0;
+        return;
+    }
+    hdr = begin_frame(n, ETHPWM_FRAME_PWM);
+    if(!hdr)
+    {
+        /* ring is full, changes are picked up in the next period */
+        return;
+    }
+    hdr->count = 0;
+    if(ethpwm_stat->apply_delay && nd->clock_valid)
+    {
+        /* all devices apply the frame of this period at the same instant */
+        pwm_time_t* at = (pwm_time_t*) (hdr + 1);
+
+        hdr->type = ETHPWM_FRAME_PWM_AT;
+        at->time = ethpwm_cpu_to_be64((__u64) (now + (long long) ethpwm_stat->apply_delay * period + nd->clock_offset));
+    } else
+    {
+        hdr->type = ETHPWM_FRAME_PWM;
+    }
+    for(i = 0; i < channels; i++)
+    {
+        if(send[i] == SEND_NONE)
+        {
+            continue;
+        }
+        if(send[i] == SEND_CHANGED)
+        {
+            save_channel(i);
+        } else if(send[i] == SEND_RETRANSMIT)
+        {
+            (*ethpwm_stat->retransmits)++;
+        }
+        add_channel(hdr, i);
+        ethpwm_old[i].sent_seq = node_data[n].seq_num;
+        ethpwm_old[i].sent_time = now;
+        ethpwm_old[i].acked = 0;
+    }
+    nd->resend = 0;
+    send_packet(n, hdr, frame_len(hdr), now);
+}
+
+/* Sends samples of all streaming channels of device n in one frame */
+static void send_stream(int n, long long now, long period)
+{
+    int i, j;
+    pwm_frame_hdr_t* hdr;
+    __u8* p;
+    __u8 flags;
+
+    if(!node_data[n].stream)
+    {
+        return;
+    }
+    hdr = begin_frame(n, ETHPWM_FRAME_STREAM);
+    if(!hdr)
+    {
+        /* samples of this period are lost, device counts underrun */
+        return;
+    }
+    hdr->type = ETHPWM_FRAME_STREAM;
+    hdr->count = 0;
+    p = (__u8*) (hdr + 1);
+    for(i = 0; i < channels; i++)
+    {
+        pwm_stream_t* blk = (pwm_stream_t*) p;
+        __be32* duty = (__be32*) (blk + 1);
+
+        if(node[i] != n || !stream[i])
+        {
+            continue;
+        }
+        blk->channel = remote_channel[i];
+        blk->enable = *ethpwm_array[i].enable;
+        blk->samples = (__u8) stream[i];
+        blk->sample_period = htonl((__u32) (period / stream[i]));
+        blk->freq = htonl(calc_freq(i));
+        /* direction is set per block by the first sample, samples of the other direction are 0 */
+        for(j = 0; j < stream[i]; j++)
+        {
+            duty[j] = htonl(calc_duty(i, *ethpwm_array[i].sample[j], &flags));
+            if(!j)
+            {
+                blk->flags = flags;
+            } else if(flags != blk->flags)
+            {
+                duty[j] = 0;
+            }
+        }
+        p += sizeof(pwm_stream_t) + stream[i] * sizeof(__be32);
+        hdr->count++;
+    }
+    send_packet(n, hdr, p - (__u8*) hdr, now);
+}
+
+static void reset_stats(void)
+{
+    int i;
+
+    tx_sent_base = READ_ONCE(tx_sent);
+    tx_alloc_fails_base = READ_ONCE(tx_alloc_fails);
+    tx_header_fails_base = READ_ONCE(tx_header_fails);
+    rtt_sum = 0;
+    rtt_count = 0;
+    *ethpwm_stat->rtt_last = 0;
+    *ethpwm_stat->rtt_max = 0;
+    *ethpwm_stat->rtt_mean = 0;
+    *ethpwm_stat->retransmits = 0;
+    *ethpwm_stat->update_time_max = 0;
+    *ethpwm_stat->frames_queued = 0;
+    *ethpwm_stat->ring_full = 0;
+    for(i = 0; i <= ETHPWM_FRAME_STEP; i++)
+    {
+        if(ethpwm_stat->ring_full_type[i])
+        {
+            *ethpwm_stat->ring_full_type[i] = 0;
+        }
+    }
+    *ethpwm_stat->backlog_max = 0;
+}
+
+/* Updates statistics pins at the end of update() started at start */
+static void update_stats(long long start)
+{
+    unsigned int backlog = tx_backlog();
+    __u32 time;
+
+    if(*ethpwm_stat->reset)
+    {
+        reset_stats();
+    }
+    *ethpwm_stat->frames_sent = READ_ONCE(tx_sent) - tx_sent_base;
+    *ethpwm_stat->alloc_fails = READ_ONCE(tx_alloc_fails) - tx_alloc_fails_base;
+    *ethpwm_stat->header_fails = READ_ONCE(tx_header_fails) - tx_header_fails_base;
+    *ethpwm_stat->backlog = backlog;
+    if(backlog > *ethpwm_stat->backlog_max)
+    {
+        *ethpwm_stat->backlog_max = backlog;
+    }
+    time = (__u32) (rtapi_get_time() - start);
+    *ethpwm_stat->update_time = time;
+    if(time > *ethpwm_stat->update_time_max)
+    {
+        *ethpwm_stat->update_time_max = time;
+    }
+}
+
+static void update(void *arg, long period)
+{
+    int n;
+    long long now = rtapi_get_time();
+
+    receive_acks();
+
+    for(n = 0; n < num_nodes; n++)
+    {
+        /* heartbeat and sync first, they are rare but keep the link up */
+        send_heartbeat(n, now);
+        send_sync(n, now);
+        update_node(n, now, period);
+        send_stream(n, now, period);
+        send_io(n, now);
+        send_step(n, now, period);
+    }
+    update_stats(now);
+}
+
+
+/***********************************************************************
+*                   LOCAL FUNCTION DEFINITIONS                         *
+************************************************************************/
+
+static int parse_nodes(void)
+{
+    int n, i;
+    int count[ETHPWM_MAX_NODES] = {0};
+    unsigned int stream_len[ETHPWM_MAX_NODES] = {0};
+
+    for(n = 0; n < ETHPWM_MAX_NODES && dst[n] && dst[n][0]; n++)
+    {
+        unsigned char* addr = node_data[n].addr;
+        if(sscanf(dst[n], "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx%*c", &addr[0], &addr[1], &addr[2], &addr[3],
+                &addr[4], &addr[5]) != ETH_ALEN)
+        {
+            rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: incorrect destrination address '%s'\n", dst[n]);
+            return -1;
+        }
+    }
+    num_nodes = n;
+    if(num_nodes == 0)
+    {
+        rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: no destination address\n");
+        return -1;
+    }
+    for(i = 0; i < channels; i++)
+    {
+        if(node[i] < 0 || node[i] >= num_nodes)
+        {
+            rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: channel %d: no destination device %d\n", i, node[i]);
+            return -1;
+        }
+        remote_channel[i] = (__u8) count[node[i]]++;
+        if(stream[i] < 0 || stream[i] > ETHPWM_MAX_SAMPLES)
+        {
+            rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: channel %d: stream must be 0..%d\n", i, ETHPWM_MAX_SAMPLES);
+            return -1;
+        }
+        if(output_type[i] < ETHPWM_OUTPUT_PWM || output_type[i] > ETHPWM_OUTPUT_PDM)
+        {
+            rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: channel %d: output_type must be 0..%d\n", i, ETHPWM_OUTPUT_PDM);
+            return -1;
+        }
+        if(output_type[i] != ETHPWM_OUTPUT_PWM && proto != ETHPWM_VERSION_32 && !stream[i])
+        {
+            rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: channel %d: output_type needs proto=2\n", i);
+            return -1;
+        }
+        if(stream[i])
+        {
+            node_data[node[i]].stream = 1;
+            stream_len[node[i]] += sizeof(pwm_stream_t) + stream[i] * sizeof(__be32);
+        }
+    }
+    for(i = 0; i < steppers; i++)
+    {
+        if(step_node[i] < 0 || step_node[i] >= num_nodes)
+        {
+            rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: step generator %d: no destination device %d\n", i, step_node[i]);
+            return -1;
+        }
+        if(node_data[step_node[i]].steppers == ETHPWM_MAX_STEP)
+        {
+            rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: device %d: too many step generators (max %d)\n",
+                            step_node[i], ETHPWM_MAX_STEP);
+            return -1;
+        }
+        remote_joint[i] = (__u8) node_data[step_node[i]].steppers++;
+    }
+    for(n = 0; n < num_nodes; n++)
+    {
+        if(din[n] < 0 || din[n] > ETHPWM_MAX_IO || dout[n] < 0 || dout[n] > ETHPWM_MAX_IO)
+        {
+            rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: device %d: din and dout must be 0..%d\n", n, ETHPWM_MAX_IO);
+            return -1;
+        }
+        if(stream_len[n] > ETHPWM_MAX_PAYLOAD)
+        {
+            rtapi_print_msg(RTAPI_MSG_ERR, "ethpwm: ERROR: samples of device %d do not fit into one frame\n", n);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int export_ethpwm(int num, ethpwm_t * addr, ethpwm_old_t* old)
+{
+    int retval, msg, i;
+
+    /* This function exports a lot of stuff, which results in a lot of
+       logging if msg_level is at INFO or ALL. So we save the current value
+       of msg_level and restore it later.  If you actually need to log this
+       function's actions, change the second line below */
+    msg = rtapi_get_msg_level();
+    rtapi_set_msg_level(RTAPI_MSG_WARN);
+
+    /* export pins */
+    retval = hal_pin_float_newf(HAL_IO, &(addr->scale), comp_id,
+        "ethpwm.%d.scale", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+
+    retval = hal_pin_float_newf(HAL_IO, &(addr->offset), comp_id,
+        "ethpwm.%d.offset", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+
+    retval = hal_pin_float_newf(HAL_IO, &(addr->pwm_freq), comp_id,
+        "ethpwm.%d.pwm-freq", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_bit_newf(HAL_IN, &(addr->enable), comp_id,
+        "ethpwm.%d.enable", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_float_newf(HAL_IN, &(addr->value), comp_id,
+        "ethpwm.%d.value", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_float_newf(HAL_IO, &(addr->deadband), comp_id,
+        "ethpwm.%d.deadband", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_IO, &(addr->min_interval), comp_id,
+        "ethpwm.%d.min-interval", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->suppressed), comp_id,
+        "ethpwm.%d.suppressed", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    if(stream[num])
+    {
+        addr->sample = hal_malloc(stream[num] * sizeof(hal_float_t*));
+        if(addr->sample == 0)
+        {
+            return -1;
+        }
+        for(i = 0; i < stream[num]; i++)
+        {
+            retval = hal_pin_float_newf(HAL_IN, &(addr->sample[i]), comp_id,
+                "ethpwm.%d.sample.%02d", num, i);
+            if (retval != 0) 
+            {
+                return retval;
+            }
+            *(addr->sample[i]) = 0.0;
+        }
+    }
+    /* set default pin values */
+    *(addr->enable) = 0;
+    *(addr->value) = 0.0;
+    *(addr->scale) = 1.0;
+    *(addr->offset) = 0.0;
+    *(addr->pwm_freq) = 0;
+    *(addr->deadband) = 0.0;
+    *(addr->min_interval) = 0;
+    *(addr->suppressed) = 0;
+    /* init old values */
+    old->enable = *(addr->enable) + 1;
+    old->value = *(addr->value) + 1.0;
+    old->scale = *(addr->scale) + 1.0;
+    old->offset = *(addr->offset) + 1.0;
+    old->pwm_freq = *(addr->pwm_freq) + 1.0;
+    old->acked = 1;
+    /* restore saved message level */
+    rtapi_set_msg_level(msg);
+    return 0;
+}
+
+static int export_stat(ethpwm_stat_t* addr)
+{
+    int retval, i;
+
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->rtt_last), comp_id, "ethpwm.rtt-last");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->rtt_max), comp_id, "ethpwm.rtt-max");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->rtt_mean), comp_id, "ethpwm.rtt-mean");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->retransmits), comp_id, "ethpwm.retransmit-count");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->update_time), comp_id, "ethpwm.update-time");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->update_time_max), comp_id, "ethpwm.update-time-max");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->frames_queued), comp_id, "ethpwm.frames-queued");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->frames_sent), comp_id, "ethpwm.frames-sent");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->alloc_fails), comp_id, "ethpwm.alloc-fails");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->header_fails), comp_id, "ethpwm.header-fails");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->ring_full), comp_id, "ethpwm.ring-full");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    for (i = 0; i <= ETHPWM_FRAME_STEP; i++) 
+    {
+        addr->ring_full_type[i] = NULL;
+        if (!frame_names[i])
+        {
+            continue;
+        }
+        retval = hal_pin_u32_newf(HAL_OUT, &(addr->ring_full_type[i]), comp_id, "ethpwm.ring-full.%s", frame_names[i]);
+        if (retval != 0) 
+        {
+            return retval;
+        }
+        *(addr->ring_full_type[i]) = 0;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->backlog), comp_id, "ethpwm.backlog");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->backlog_max), comp_id, "ethpwm.backlog-max");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_bit_newf(HAL_IN, &(addr->reset), comp_id, "ethpwm.reset-stats");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_param_u32_newf(HAL_RW, &(addr->retransmit_timeout), comp_id, "ethpwm.retransmit-timeout");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_param_u32_newf(HAL_RW, &(addr->apply_delay), comp_id, "ethpwm.apply-delay");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_param_u32_newf(HAL_RW, &(addr->sync_interval), comp_id, "ethpwm.sync-interval");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_param_u32_newf(HAL_RW, &(addr->keepalive), comp_id, "ethpwm.keepalive");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_param_u32_newf(HAL_RW, &(addr->io_timeout), comp_id, "ethpwm.io-timeout");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_param_u32_newf(HAL_RW, &(addr->heartbeat), comp_id, "ethpwm.heartbeat");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_param_u32_newf(HAL_RW, &(addr->watchdog_timeout), comp_id, "ethpwm.watchdog-timeout");
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    *(addr->rtt_last) = 0;
+    *(addr->rtt_max) = 0;
+    *(addr->rtt_mean) = 0;
+    *(addr->retransmits) = 0;
+    *(addr->update_time) = 0;
+    *(addr->update_time_max) = 0;
+    *(addr->frames_queued) = 0;
+    *(addr->frames_sent) = 0;
+    *(addr->alloc_fails) = 0;
+    *(addr->header_fails) = 0;
+    *(addr->ring_full) = 0;
+    *(addr->backlog) = 0;
+    *(addr->backlog_max) = 0;
+    *(addr->reset) = 0;
+    addr->retransmit_timeout = 10000000;
+    addr->apply_delay = 0;
+    addr->sync_interval = 100000000;
+    addr->keepalive = 0;
+    addr->io_timeout = 10000000;
+    addr->heartbeat = 10000000;
+    addr->watchdog_timeout = 100000000;
+    return 0;
+}
+
+static int export_step(int num, ethpwm_step_t* addr)
+{
+    int retval;
+
+    retval = hal_pin_bit_newf(HAL_IN, &(addr->enable), comp_id, "ethpwm.step.%d.enable", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_bit_newf(HAL_IN, &(addr->control_type), comp_id, "ethpwm.step.%d.control-type", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_float_newf(HAL_IN, &(addr->position_cmd), comp_id, "ethpwm.step.%d.position-cmd", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_float_newf(HAL_IN, &(addr->velocity_cmd), comp_id, "ethpwm.step.%d.velocity-cmd", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_float_newf(HAL_IO, &(addr->position_scale), comp_id, "ethpwm.step.%d.position-scale", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_float_newf(HAL_OUT, &(addr->position_fb), comp_id, "ethpwm.step.%d.position-fb", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_s32_newf(HAL_OUT, &(addr->counts), comp_id, "ethpwm.step.%d.counts", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_IO, &(addr->steplen), comp_id, "ethpwm.step.%d.steplen", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_IO, &(addr->dirhold), comp_id, "ethpwm.step.%d.dirhold", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_IO, &(addr->dirsetup), comp_id, "ethpwm.step.%d.dirsetup", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_bit_newf(HAL_OUT, &(addr->fb_valid), comp_id, "ethpwm.step.%d.fb-valid", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    *(addr->enable) = 0;
+    *(addr->control_type) = 0;
+    *(addr->position_cmd) = 0.0;
+    *(addr->velocity_cmd) = 0.0;
+    *(addr->position_scale) = 1.0;
+    *(addr->position_fb) = 0.0;
+    *(addr->counts) = 0;
+    *(addr->steplen) = 5000;
+    *(addr->dirhold) = 5000;
+    *(addr->dirsetup) = 5000;
+    *(addr->fb_valid) = 0;
+    addr->fb_time = 0;
+    return 0;
+}
+
+static int export_node(int num, ethpwm_node_t* addr)
+{
+    int retval, i, base_in, base_out;
+
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->tx_frames), comp_id, "ethpwm.node.%d.tx-frames", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->tx_records), comp_id, "ethpwm.node.%d.tx-records", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->rx_acks), comp_id, "ethpwm.node.%d.rx-acks", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->sync_rtt), comp_id, "ethpwm.node.%d.sync-rtt", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_s32_newf(HAL_OUT, &(addr->apply_jitter), comp_id, "ethpwm.node.%d.apply-jitter", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->apply_jitter_max), comp_id, "ethpwm.node.%d.apply-jitter-max", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->apply_late), comp_id, "ethpwm.node.%d.apply-late", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->stream_underruns), comp_id, "ethpwm.node.%d.stream-underruns", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->stream_overruns), comp_id, "ethpwm.node.%d.stream-overruns", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    retval = hal_pin_u32_newf(HAL_OUT, &(addr->watchdog_timeouts), comp_id, "ethpwm.node.%d.watchdog-timeouts", num);
+    if (retval != 0) 
+    {
+        return retval;
+    }
+    /* remote I/O pins are numbered in order of devices */
+    for(i = 0, base_in = 0, base_out = 0; i < num; i++)
+    {
+        base_in += din[i];
+        base_out += dout[i];
+    }
+    if(din[num] || dout[num])
+    {
+        addr->in = hal_malloc((din[num] + 1) * sizeof(hal_bit_t*));
+        addr->out = hal_malloc((dout[num] + 1) * sizeof(hal_bit_t*));
+        if(addr->in == 0 || addr->out == 0)
+        {
+            return -1;
+        }
+        retval = hal_pin_bit_newf(HAL_OUT, &(addr->in_valid), comp_id, "ethpwm.node.%d.in-valid", num);
+        if (retval != 0) 
+        {
+            return retval;
+        }
+        *(addr->in_valid) = 0;
+    }
+    for(i = 0; i < din[num]; i++)
+    {
+        retval = hal_pin_bit_newf(HAL_OUT, &(addr->in[i]), comp_id, "ethpwm.in-%02d", base_in + i);
+        if (retval != 0) 
+        {
+            return retval;
+        }
+        *(addr->in[i]) = 0;
+    }
+    for(i = 0; i < dout[num]; i++)
+    {
+        retval = hal_pin_bit_newf(HAL_IN, &(addr->out[i]), comp_id, "ethpwm.out-%02d", base_out + i);
+        if (retval != 0) 
+        {
+            return retval;
+        }
+        *(addr->out[i]) = 0;
+    }
+    *(addr->tx_frames) = 0;
+    *(addr->tx_records) = 0;
+    *(addr->rx_acks) = 0;
+    *(addr->sync_rtt) = 0;
+    *(addr->apply_jitter) = 0;
+    *(addr->apply_jitter_max) = 0;
+    *(addr->apply_late) = 0;
+    *(addr->stream_underruns) = 0;
+    *(addr->stream_overruns) = 0;
+    *(addr->watchdog_timeouts) = 0;
+    return 0;
+}
@@ -0,0 +1,726 @@
+/* ethpwm traffic capture and analyzer.
+ *
+ * Capture mode sniffs ethertype 0xEAEB frames in both directions on an
+ * interface, decodes legacy packets and extended frames and writes one compact
+ * record per frame to a binary log: timestamp (hardware when the NIC provides
+ * it), direction, peer MAC, type, seq and the channels carried by the frame.
+ * Report mode reads a log and prints frame counts, inter-frame interval
+ * statistics and histogram, ack delay, seq gaps and per-channel update rates.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <linux/errqueue.h>
+
+#include "ethpwm_proto.h"
+
+#define CAP_MAGIC               "EPWMCAP2"
+#define CAP_OUTGOING            0x01    /* frame sent by the capturing host */
+#define CAP_HW_TIME             0x02    /* time is a NIC hardware timestamp */
+#define CAP_LEGACY              0x04    /* legacy single-channel packet */
+#define CAP_MALFORMED           0x08    /* frame is shorter than its header says */
+#define CAP_USER_TIME           0x10    /* no kernel timestamp, sw_time read by the capture after reception */
+#define CAP_CLOCK               (CAP_HW_TIME | CAP_USER_TIME)   /* source of time, compared only within one source */
+#define BUF_SIZ                 2048
+#define MAX_STREAMS             32      /* peer and direction pairs in a report */
+#define SEQ_RESYNC_WINDOW       1024
+#define ACK_RING_SIZE           1024    /* sent frames remembered for ack matching, power of 2 */
+#define HIST_SIZE               16      /* interval buckets: < 1 us, < 2 us, < 4 us .. >= 16 ms */
+#define TYPE_LEGACY             (ETHPWM_FRAME_STEP_FB + 1)      /* frame type counters: frame types, */
+#define TYPE_UNKNOWN            (ETHPWM_FRAME_STEP_FB + 2)      /* legacy packets and unknown types */
+#define NUM_TYPES               (ETHPWM_FRAME_STEP_FB + 3)
+
+/* Log record, host byte order, followed by count channel numbers */
+typedef struct __attribute__((packed))
+{
+    uint64_t    time;       /* ns, NIC clock with CAP_HW_TIME, otherwise sw_time */
+    uint64_t    sw_time;    /* ns, CLOCK_REALTIME, software timestamp of every frame */
+    uint32_t    seq;
+    uint16_t    len;        /* frame length without ethernet header */
+    uint8_t     peer[6];    /* destination of sent frames, source of received frames */
+    uint8_t     flags;
+    uint8_t     type;
+    uint8_t     version;
+    uint8_t     count;
+} cap_record_t;
+
+/* Report state of frames exchanged with one peer in one direction */
+typedef struct
+{
+    uint8_t     peer[6];
+    int         outgoing;
+    unsigned long   frames;
+    unsigned long   types[NUM_TYPES];
+    unsigned long   malformed;
+    /* data frames: legacy, PWM, PWM_AT and STREAM */
+    unsigned long   data;
+    uint64_t        data_last;
+    uint8_t         data_clock;     /* CAP_CLOCK of data_last */
+    unsigned long   clock_changes;  /* intervals not measured because the timestamp source changed */
+    uint32_t*       intervals;      /* ns */
+    unsigned long   num_intervals;
+    unsigned long   size_intervals;
+    unsigned long   hist[HIST_SIZE];
+    int             seq_init;
+    uint32_t        seq;
+    unsigned long   lost, reordered, duplicate, max_gap;
+    /* acks of sent frames, matched by seq */
+    uint32_t        ack_seq[ACK_RING_SIZE];
+    uint64_t        ack_time[ACK_RING_SIZE];      /* sw_time */
+    uint8_t         ack_clock[ACK_RING_SIZE];     /* CAP_USER_TIME of ack_time */
+    uint32_t*       ack_delays;     /* ns */
+    unsigned long   num_ack_delays;
+    unsigned long   size_ack_delays;
+    /* per channel */
+    unsigned long   records[ETHPWM_EXT_MARKER];
+    uint64_t        ch_last[ETHPWM_EXT_MARKER];   /* sw_time */
+    uint64_t        ch_max_gap[ETHPWM_EXT_MARKER];
+} stream_t;
+
+static const char* type_names[NUM_TYPES] = {"pwm", "ack", "pwm_at", "sync", "stream", "io", "heartbeat", "step",
+                                            "step_fb", "legacy", "unknown"};
+static volatile sig_atomic_t stop;
+/* NIC timestamping setting before --hwstamp changed it */
+static struct hwtstamp_config saved_hwstamp;
+static int hwstamp_changed;
+
+static void on_signal(int sig)
+{
+    (void) sig;
+    stop = 1;
+}
+
+void print_usage()
+{
+    printf("Capture and analyze ethpwm traffic.\n\n"
+           "Capture (root):\n"
+           "--iface=IFACE      - interface to capture on\n"
+           "--write=FILE       - binary log to write\n"
+           "--count=N          - stop after N frames (default: on SIGINT)\n"
+           "--duration=S       - stop after S seconds\n"
+           "--hwstamp          - enable hardware receive timestamps of the NIC while capturing (SIOCSHWTSTAMP)\n\n"
+           "Report:\n"
+           "--read=FILE        - binary log to analyze\n");
+}
+
+/* Fills record and channel list from the frame after the ethernet header */
+static void decode_frame(const uint8_t* p, unsigned int len, cap_record_t* rec, uint8_t* ch)
+{
+    const pwm_frame_hdr_t* hdr = (const pwm_frame_hdr_t*) p;
+    const pwm_stream_t* blk;
+    unsigned int rec_size, off, i;
+    int needed;
+
+    rec->len = len;
+    rec->count = 0;
+    if(len < sizeof(pwm_frame_hdr_t))
+    {
+        rec->flags |= CAP_MALFORMED;
+        return;
+    }
+    rec->seq = ntohl(hdr->seq);
+    if(hdr->marker != ETHPWM_EXT_MARKER)
+    {
+        rec->flags |= CAP_LEGACY;
+        if(len < sizeof(pwm_packet_t))
+        {
+            rec->flags |= CAP_MALFORMED;
+            return;
+        }
+        ch[rec->count++] = ((const pwm_packet_t*) p)->channel;
+        return;
+    }
+    rec->type = hdr->type;
+    rec->version = hdr->version;
+    needed = ethpwm_frame_len(p, len);
+    if(needed < 0 || (unsigned int) needed > len)
+    {
+        rec->flags |= CAP_MALFORMED;
+        return;
+    }
+    switch(hdr->type)
+    {
+        case ETHPWM_FRAME_PWM:
+        case ETHPWM_FRAME_PWM_AT:
+            rec_size = ethpwm_record_size(hdr->version);
+            off = ethpwm_records_offset(hdr);
+            for(i = 0; i < hdr->count; i++, off += rec_size)
+            {
+                /* channel is the first byte of any record */
+                ch[rec->count++] = p[off];
+            }
+            break;
+        case ETHPWM_FRAME_STREAM:
+            off = sizeof(pwm_frame_hdr_t);
+            for(i = 0; i < hdr->count; i++)
+            {
+                blk = (const pwm_stream_t*) (p + off);
+                ch[rec->count++] = blk->channel;
+                off += sizeof(pwm_stream_t) + blk->samples * sizeof(__be32);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static int open_capture(const char* iface, int hwstamp)
+{
+    struct sock_filter code[] = {
+        /* accept frames of ETHPWM_ETHERTYPE only */
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHPWM_ETHERTYPE, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFF),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    struct sockaddr_ll addr = {0};
+    struct hwtstamp_config cfg = {0};
+    struct ifreq ifr;
+    struct timeval tv = { 0, 200000 };
+    int flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    int fd;
+
+    /* protocol 0 receives nothing until bind, so no frame passes before the filter */
+    fd = socket(AF_PACKET, SOCK_RAW, 0);
+    if(fd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+    {
+        perror("SO_ATTACH_FILTER");
+        return -1;
+    }
+    /* ETH_P_ALL sees frames sent by this host as well */
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = if_nametoindex(iface);
+    if(!addr.sll_ifindex)
+    {
+        perror(iface);
+        return -1;
+    }
+    if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+    {
+        perror("bind");
+        return -1;
+    }
+    if(hwstamp)
+    {
+        /* the setting is shared with other users of the NIC, keep it to restore on exit */
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, iface, IFNAMSIZ - 1);
+        ifr.ifr_data = (char*) &saved_hwstamp;
+        if(ioctl(fd, SIOCGHWTSTAMP, &ifr) < 0)
+        {
+            printf("%s: cannot read hardware timestamp setting (%s), using software timestamps\n", iface,
+                   strerror(errno));
+        } else if(saved_hwstamp.rx_filter != HWTSTAMP_FILTER_ALL)
+        {
+            cfg = saved_hwstamp;
+            cfg.rx_filter = HWTSTAMP_FILTER_ALL;
+            ifr.ifr_data = (char*) &cfg;
+            if(ioctl(fd, SIOCSHWTSTAMP, &ifr) < 0)
+            {
+                printf("%s: no hardware timestamps (%s), using software timestamps\n", iface, strerror(errno));
+            } else
+            {
+                hwstamp_changed = 1;
+            }
+        }
+    }
+    if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    {
+        perror("SO_TIMESTAMPING");
+        return -1;
+    }
+    /* wake up to check for stop */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+/* Puts back the NIC timestamping setting changed by open_capture */
+static void close_capture(int fd, const char* iface)
+{
+    struct ifreq ifr;
+
+    if(hwstamp_changed)
+    {
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, iface, IFNAMSIZ - 1);
+        ifr.ifr_data = (char*) &saved_hwstamp;
+        if(ioctl(fd, SIOCSHWTSTAMP, &ifr) < 0)
+        {
+            printf("%s: cannot restore hardware timestamp setting (%s)\n", iface, strerror(errno));
+        }
+        hwstamp_changed = 0;
+    }
+    close(fd);
+}
+
+static int capture(const char* iface, const char* path, unsigned long max_count, double duration, int hwstamp)
+{
+    uint8_t buf[BUF_SIZ];
+    uint8_t ch[256];
+    char ctrl[CMSG_SPACE(sizeof(struct scm_timestamping))];
+    const struct ether_header* eh = (const struct ether_header*) buf;
+    struct sockaddr_ll from;
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    const struct scm_timestamping* tss;
+    struct timespec ts;
+    struct sigaction sa;
+    cap_record_t rec;
+    unsigned long count = 0, hw = 0;
+    long long end = 0;
+    ssize_t len;
+    FILE* f;
+    int fd;
+
+    fd = open_capture(iface, hwstamp);
+    if(fd < 0)
+    {
+        return -1;
+    }
+    f = fopen(path, "wb");
+    if(!f)
+    {
+        perror(path);
+        close_capture(fd, iface);
+        return -1;
+    }
+    fwrite(CAP_MAGIC, 1, 8, f);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    if(duration > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        end = ts.tv_sec * 1000000000LL + ts.tv_nsec + (long long) (duration * 1e9);
+    }
+
+    while(!stop && (!max_count || count < max_count))
+    {
+        if(end)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            if(ts.tv_sec * 1000000000LL + ts.tv_nsec >= end)
+            {
+                break;
+            }
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+        len = recvmsg(fd, &msg, 0);
+        if(len < 0)
+        {
+            if(errno == EAGAIN || errno == EINTR)
+            {
+                continue;
+            }
+            perror("recvmsg");
+            break;
+        }
+        if(len < ETH_HLEN)
+        {
+            continue;
+        }
+
+        memset(&rec, 0, sizeof(rec));
+        if(from.sll_pkttype == PACKET_OUTGOING)
+        {
+            rec.flags |= CAP_OUTGOING;
+            memcpy(rec.peer, eh->ether_dhost, ETH_ALEN);
+        } else
+        {
+            memcpy(rec.peer, eh->ether_shost, ETH_ALEN);
+        }
+        for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+            {
+                /* ts[0] is software, ts[2] raw hardware timestamp in the NIC clock */
+                tss = (const struct scm_timestamping*) CMSG_DATA(cmsg);
+                rec.sw_time = tss->ts[0].tv_sec * 1000000000ULL + tss->ts[0].tv_nsec;
+                if(tss->ts[2].tv_sec || tss->ts[2].tv_nsec)
+                {
+                    rec.time = tss->ts[2].tv_sec * 1000000000ULL + tss->ts[2].tv_nsec;
+                    rec.flags |= CAP_HW_TIME;
+                    hw++;
+                }
+            }
+        }
+        if(!rec.sw_time)
+        {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            rec.sw_time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+            rec.flags |= CAP_USER_TIME;
+        }
+        if(!(rec.flags & CAP_HW_TIME))
+        {
+            rec.time = rec.sw_time;
+        }
+        decode_frame(buf + ETH_HLEN, len - ETH_HLEN, &rec, ch);
+        if(fwrite(&rec, sizeof(rec), 1, f) != 1 || fwrite(ch, 1, rec.count, f) != rec.count)
+        {
+            perror(path);
+            break;
+        }
+        count++;
+    }
+    fclose(f);
+    close_capture(fd, iface);
+    printf("%lu frames captured, %lu with hardware timestamps\n", count, hw);
+    return 0;
+}
+
+static int push(uint32_t** array, unsigned long* num, unsigned long* size, uint64_t value)
+{
+    uint32_t* p;
+
+    if(*num == *size)
+    {
+        *size = *size ? *size * 2 : 4096;
+        p = realloc(*array, *size * sizeof(uint32_t));
+        if(!p)
+        {
+            return -1;
+        }
+        *array = p;
+    }
+    (*array)[(*num)++] = value > UINT32_MAX ? UINT32_MAX : (uint32_t) value;
+    return 0;
+}
+
+static stream_t* find_stream(stream_t* streams, int* num, const cap_record_t* rec)
+{
+    int outgoing = !!(rec->flags & CAP_OUTGOING);
+    int i;
+
+    for(i = 0; i < *num; i++)
+    {
+        if(streams[i].outgoing == outgoing && !memcmp(streams[i].peer, rec->peer, ETH_ALEN))
+        {
+            return &streams[i];
+        }
+    }
+    if(*num == MAX_STREAMS)
+    {
+        return NULL;
+    }
+    memcpy(streams[*num].peer, rec->peer, ETH_ALEN);
+    streams[*num].outgoing = outgoing;
+    return &streams[(*num)++];
+}
+
+/* Same accounting as the receivers, a jump of more than SEQ_RESYNC_WINDOW restarts the sequence */
+static void check_seq(stream_t* s, uint32_t seq)
+{
+    int32_t diff = (int32_t) (seq - s->seq - 1);
+
+    if(!s->seq_init || diff < -SEQ_RESYNC_WINDOW || diff > SEQ_RESYNC_WINDOW)
+    {
+        s->seq = seq;
+        s->seq_init = 1;
+        return;
+    }
+    if(diff == -1)
+    {
+        s->duplicate++;
+        return;
+    }
+    if(diff < 0)
+    {
+        s->reordered++;
+        return;
+    }
+    s->lost += diff;
+    if((unsigned long) diff > s->max_gap)
+    {
+        s->max_gap = diff;
+    }
+    s->seq = seq;
+}
+
+static void add_record(stream_t* streams, int num, stream_t* s, const cap_record_t* rec, const uint8_t* ch)
+{
+    stream_t* tx;
+    uint64_t interval;
+    unsigned int bucket, slot, i;
+    int data, j;
+
+    s->frames++;
+    s->types[rec->flags & CAP_LEGACY ? TYPE_LEGACY : (rec->type <= ETHPWM_FRAME_STEP_FB ? rec->type : TYPE_UNKNOWN)]++;
+    if(rec->flags & CAP_MALFORMED)
+    {
+        s->malformed++;
+        return;
+    }
+    data = rec->flags & CAP_LEGACY || rec->type == ETHPWM_FRAME_PWM || rec->type == ETHPWM_FRAME_PWM_AT ||
+           rec->type == ETHPWM_FRAME_STREAM;
+    if(data)
+    {
+        /* NIC and system clocks are not comparable, the interval is measured within one source */
+        if(s->data && s->data_clock != (rec->flags & CAP_CLOCK))
+        {
+            s->clock_changes++;
+        } else if(s->data)
+        {
+            interval = rec->time - s->data_last;
+            push(&s->intervals, &s->num_intervals, &s->size_intervals, interval);
+            for(bucket = 0; bucket < HIST_SIZE - 1 && interval >= (1000ULL << bucket); bucket++)
+            {
+            }
+            s->hist[bucket]++;
+        }
+        s->data++;
+        s->data_last = rec->time;
+        s->data_clock = rec->flags & CAP_CLOCK;
+        check_seq(s, rec->seq);
+        slot = rec->seq & (ACK_RING_SIZE - 1);
+        s->ack_seq[slot] = rec->seq;
+        s->ack_time[slot] = rec->sw_time;
+        s->ack_clock[slot] = rec->flags & CAP_USER_TIME;
+    } else if(rec->type == ETHPWM_FRAME_ACK)
+    {
+        /* ack travels in the other direction than the acknowledged frame, sent frames have software
+           timestamps only, so the round trip is measured with software timestamps in both directions */
+        for(j = 0; j < num; j++)
+        {
+            tx = &streams[j];
+            slot = rec->seq & (ACK_RING_SIZE - 1);
+            if(tx->outgoing != s->outgoing && !memcmp(tx->peer, s->peer, ETH_ALEN) &&
+               tx->ack_seq[slot] == rec->seq && tx->ack_time[slot] &&
+               tx->ack_clock[slot] == (rec->flags & CAP_USER_TIME) && rec->sw_time >= tx->ack_time[slot])
+            {
+                push(&tx->ack_delays, &tx->num_ack_delays, &tx->size_ack_delays, rec->sw_time - tx->ack_time[slot]);
+                tx->ack_time[slot] = 0;
+            }
+        }
+    }
+    for(i = 0; i < rec->count; i++)
+    {
+        if(ch[i] >= ETHPWM_EXT_MARKER)
+        {
+            continue;
+        }
+        if(s->records[ch[i]] && rec->sw_time - s->ch_last[ch[i]] > s->ch_max_gap[ch[i]])
+        {
+            s->ch_max_gap[ch[i]] = rec->sw_time - s->ch_last[ch[i]];
+        }
+        s->records[ch[i]]++;
+        s->ch_last[ch[i]] = rec->sw_time;
+    }
+}
+
+static int cmp_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_distribution(const char* name, uint32_t* v, unsigned long n)
+{
+    double sum = 0.0, sq = 0.0, mean;
+    unsigned long i;
+
+    if(!n)
+    {
+        return;
+    }
+    for(i = 0; i < n; i++)
+    {
+        sum += v[i];
+    }
+    mean = sum / n;
+    for(i = 0; i < n; i++)
+    {
+        sq += (v[i] - mean) * (v[i] - mean);
+    }
+    qsort(v, n, sizeof(uint32_t), cmp_u32);
+    printf("  %s (us): mean %.1f, stddev %.1f, min %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+           name, mean / 1e3, (n > 1 ? sqrt(sq / (n - 1)) : 0.0) / 1e3, v[0] / 1e3, v[n / 2] / 1e3,
+           v[n * 9 / 10] / 1e3, v[n * 99 / 100] / 1e3, v[n * 999 / 1000] / 1e3, v[n - 1] / 1e3);
+}
+
+static void print_stream(const stream_t* s, double span)
+{
+    unsigned long i;
+
+    printf("\n%s %02x:%02x:%02x:%02x:%02x:%02x: %lu frames, %lu malformed\n", s->outgoing ? "to" : "from",
+           s->peer[0], s->peer[1], s->peer[2], s->peer[3], s->peer[4], s->peer[5], s->frames, s->malformed);
+    printf("  types:");
+    for(i = 0; i < NUM_TYPES; i++)
+    {
+        if(s->types[i])
+        {
+            printf(" %s %lu", type_names[i], s->types[i]);
+        }
+    }
+    printf("\n");
+    if(!s->data)
+    {
+        return;
+    }
+    printf("  data frames: %lu, %.1f/s, seq lost %lu (max gap %lu), reordered %lu, duplicate %lu\n",
+           s->data, span > 0 ? s->data / span : 0.0, s->lost, s->max_gap, s->reordered, s->duplicate);
+    if(s->clock_changes)
+    {
+        printf("  intervals not measured across timestamp sources: %lu\n", s->clock_changes);
+    }
+    print_distribution("interval", s->intervals, s->num_intervals);
+    print_distribution("ack delay", s->ack_delays, s->num_ack_delays);
+    if(s->num_intervals)
+    {
+        printf("  interval histogram:");
+        for(i = 0; i < HIST_SIZE; i++)
+        {
+            if(s->hist[i])
+            {
+                printf(" %s%lu %lu", i == HIST_SIZE - 1 ? ">=" : "<", i == HIST_SIZE - 1 ? 1UL << (i - 1) : 1UL << i,
+                       s->hist[i]);
+            }
+        }
+        printf("\n");
+    }
+    printf("  channel  records   rate/s  max_gap_us\n");
+    for(i = 0; i < ETHPWM_EXT_MARKER; i++)
+    {
+        if(s->records[i])
+        {
+            printf("  %7lu %8lu %8.1f %11.1f\n", i, s->records[i], span > 0 ? s->records[i] / span : 0.0,
+                   s->ch_max_gap[i] / 1e3);
+        }
+    }
+}
+
+static int report(const char* path)
+{
+    static stream_t streams[MAX_STREAMS];
+    uint8_t ch[256];
+    char magic[8];
+    cap_record_t rec;
+    stream_t* s;
+    unsigned long frames = 0, hw = 0;
+    uint64_t first = 0, last = 0;
+    double span;
+    int num = 0, i;
+    FILE* f = fopen(path, "rb");
+
+    if(!f)
+    {
+        perror(path);
+        return -1;
+    }
+    if(fread(magic, 1, 8, f) != 8 || memcmp(magic, CAP_MAGIC, 8))
+    {
+        printf("%s: not an ethpwm capture\n", path);
+        fclose(f);
+        return -1;
+    }
+    while(fread(&rec, sizeof(rec), 1, f) == 1 && fread(ch, 1, rec.count, f) == rec.count)
+    {
+        if(!frames)
+        {
+            first = rec.sw_time;
+        }
+        last = rec.sw_time;
+        frames++;
+        hw += !!(rec.flags & CAP_HW_TIME);
+        s = find_stream(streams, &num, &rec);
+        if(s)
+        {
+            add_record(streams, num, s, &rec, ch);
+        }
+    }
+    fclose(f);
+
+    span = (last - first) / 1e9;
+    printf("%lu frames in %.3f s, %lu with hardware timestamps\n", frames, span, hw);
+    for(i = 0; i < num; i++)
+    {
+        print_stream(&streams[i], span);
+        free(streams[i].intervals);
+        free(streams[i].ack_delays);
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* iface = NULL;
+    const char* write_path = NULL;
+    const char* read_path = NULL;
+    unsigned long count = 0;
+    double duration = 0.0;
+    int hwstamp = 0;
+    int c, option_index;
+    struct option long_options[] = {
+            {"iface",       required_argument,  0, 'i'},
+            {"write",       required_argument,  0, 'w'},
+            {"count",       required_argument,  0, 'c'},
+            {"duration",    required_argument,  0, 'd'},
+            {"hwstamp",     no_argument,        0, 'H'},
+            {"read",        required_argument,  0, 'r'},
+            {"help",        no_argument,        0, 'h'},
+            {0,             0,                  0, 0}
+    };
+
+    while((c = getopt_long(argc, argv, "i:w:c:d:Hr:h", long_options, &option_index)) != -1)
+    {
+        switch (c)
+        {
+            case 'i': iface = optarg; break;
+            case 'w': write_path = optarg; break;
+            case 'c': count = strtoul(optarg, NULL, 10); break;
+            case 'd': duration = atof(optarg); break;
+            case 'H': hwstamp = 1; break;
+            case 'r': read_path = optarg; break;
+            case 'h':
+            case '?':
+                print_usage();
+                exit(EXIT_SUCCESS);
+            default:
+                printf("?? getopt returned character code 0%o ??\n", c);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(read_path)
+    {
+        return report(read_path) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if(!iface || !write_path)
+    {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    return capture(iface, write_path, count, duration, hwstamp) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
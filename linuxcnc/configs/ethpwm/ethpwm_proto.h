@@ -0,0 +1,343 @@
+/* ethpwm wire protocol.
+ *
+ * Frame layouts and encode/decode helpers shared by the HAL module, the kernel
+ * module, the userspace receiver and the tools. Header only, builds in kernel
+ * and userspace. All multibyte fields are big endian.
+ */
+#ifndef ETHPWM_PROTO_H
+#define ETHPWM_PROTO_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <asm/byteorder.h>
+#define ethpwm_cpu_to_be64(x)   cpu_to_be64(x)
+#define ethpwm_be64_to_cpu(x)   be64_to_cpu(x)
+#define ethpwm_div_u64(n, d)    div_u64(n, d)
+#else
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <endian.h>
+#include <linux/types.h>
+#define ethpwm_cpu_to_be64(x)   htobe64(x)
+#define ethpwm_be64_to_cpu(x)   be64toh(x)
+#define ethpwm_div_u64(n, d)    ((n) / (d))
+#endif
+
+#define ETHPWM_ETHERTYPE        0xEAEB
+#define ETHPWM_EXT_MARKER       0xFF    /* channel number which marks an extended frame */
+#define ETHPWM_VERSION          1       /* records are pwm_record_t */
+#define ETHPWM_VERSION_32       2       /* records are pwm_record32_t */
+#define ETHPWM_FRAME_PWM        0       /* frame carries PWM records */
+#define ETHPWM_FRAME_ACK        1       /* receiver acknowledges applied frame seq */
+#define ETHPWM_FRAME_PWM_AT     2       /* PWM records applied at pwm_time_t which follows the header */
+#define ETHPWM_FRAME_SYNC       3       /* clock offset exchange, pwm_sync_t follows the header */
+#define ETHPWM_FRAME_STREAM     4       /* count blocks of duty samples, pwm_stream_t each */
+#define ETHPWM_FRAME_IO         5       /* count digital outputs (to device) or inputs (from device) bitmap */
+#define ETHPWM_FRAME_HEARTBEAT  6       /* host is alive, pwm_heartbeat_t follows the header */
+#define ETHPWM_FRAME_STEP       7       /* count step generator targets, pwm_step_t each */
+#define ETHPWM_FRAME_STEP_FB    8       /* count generated positions (from device), pwm_step_fb_t each */
+#define ETHPWM_DUTY_ONE         0x80000000u /* duty cycle 1.0, duty is Q1.31 */
+#define ETHPWM_FREQ_SHIFT       8       /* frequency is Q24.8 Hz */
+#define ETHPWM_FLAG_DIR         0x01    /* output flags: direction output is set (negative value) */
+#define ETHPWM_FLAG_PDM         0x02    /* output flags: pulse density modulation instead of PWM */
+#define ETHPWM_MAX_IO           64      /* inputs or outputs in one I/O frame */
+#define ETHPWM_IO_BYTES(n)      (((n) + 7) / 8)
+#define ETHPWM_MAX_STEP         16      /* step generators in one step frame */
+#define ETHPWM_STEP_POSITION    0       /* step target is position at the end of period */
+#define ETHPWM_STEP_VELOCITY    1       /* step target is velocity */
+#define ETHPWM_STEP_SHIFT       16      /* step target is Q48.16 steps or steps/s */
+#define ETHPWM_VLAN_ETH_HLEN    18      /* ethernet header with 802.1Q tag */
+#define ETHPWM_VLAN_MAX         4094    /* max 802.1Q VLAN id, 0 - priority tag only */
+#define ETHPWM_PCP_MAX          7       /* max 802.1Q priority code point */
+
+/* Legacy single-channel packet, as sent by send_ethpwm */
+typedef struct __attribute__((packed))
+{
+    __be32  seq;
+    __u8    channel;
+    __u8    enable;
+    __be16  value;
+    __be16  scale;
+    __be16  offset;
+    __be16  freq;
+} pwm_packet_t;
+
+/* Extended frame header. Layout of seq and marker matches the legacy
+   single-channel packet, so receiver can tell them apart by marker. */
+typedef struct __attribute__((packed))
+{
+    __be32  seq;
+    __u8    marker;
+    __u8    version;
+    __u8    type;
+    __u8    count;      /* number of records following the header */
+} pwm_frame_hdr_t;
+
+typedef struct __attribute__((packed))
+{
+    __u8    channel;
+    __u8    enable;
+    __be16  value;
+    __be16  scale;
+    __be16  offset;
+    __be16  freq;
+} pwm_record_t;
+
+/* Version 2 record. Duty cycle (value / scale + offset) is calculated on the host */
+typedef struct __attribute__((packed))
+{
+    __u8    channel;
+    __u8    enable;
+    __u8    flags;      /* ETHPWM_FLAG_* */
+    __u8    reserved;
+    __be32  duty;
+    __be32  freq;
+} pwm_record32_t;
+
+/* Apply time of ETHPWM_FRAME_PWM_AT records, ns of receiver monotonic clock */
+typedef struct __attribute__((packed))
+{
+    __be64  time;
+} pwm_time_t;
+
+/* Clock sync request (t1 set) and reply (all fields set) */
+typedef struct __attribute__((packed))
+{
+    __be64  t1;             /* host time of request */
+    __be64  t2;             /* receiver time of request reception */
+    __be64  t3;             /* receiver time of reply */
+    __be32  jitter_last;    /* signed ns, last apply time error */
+    __be32  jitter_max;     /* ns, max absolute apply time error */
+    __be32  late;           /* number of frames received after apply time */
+    __be32  stream_underrun;    /* number of stream buffer underruns */
+    __be32  stream_overrun;     /* number of samples dropped on full stream buffer */
+} pwm_sync_t;
+
+/* Heartbeat request (timeout set) and reply (both fields set) */
+typedef struct __attribute__((packed))
+{
+    __be32  timeout;        /* ns without frames after which the device goes to safe state, 0 - never */
+    __be32  timeouts;       /* number of times the device went to safe state */
+} pwm_heartbeat_t;
+
+/* Block of duty samples of one channel, followed by samples * __be32 duty (Q1.31) */
+typedef struct __attribute__((packed))
+{
+    __u8    channel;
+    __u8    enable;
+    __u8    samples;
+    __u8    flags;          /* ETHPWM_FLAG_*, for all samples of the block */
+    __be32  sample_period;  /* ns */
+    __be32  freq;           /* Q24.8 Hz */
+} pwm_stream_t;
+
+/* Target of one step generator, sent every servo period */
+typedef struct __attribute__((packed))
+{
+    __u8    joint;          /* step generator of the device */
+    __u8    enable;
+    __u8    mode;           /* ETHPWM_STEP_POSITION or ETHPWM_STEP_VELOCITY */
+    __u8    reserved;
+    __be32  period;         /* ns, position target is reached in this time */
+    __be32  step_len;       /* ns, step pulse length and min space between pulses */
+    __be32  dir_hold;       /* ns, min time from the last step to direction change */
+    __be32  dir_setup;      /* ns, min time from direction change to the next step */
+    __be64  target;         /* signed Q48.16 steps (position) or steps/s (velocity) */
+} pwm_step_t;
+
+/* Position generated by one step generator, the device answers step frames with it */
+typedef struct __attribute__((packed))
+{
+    __u8    joint;
+    __u8    reserved[3];
+    __be32  position;       /* signed steps */
+} pwm_step_fb_t;
+
+/* Channel state normalized from any packet or record version */
+typedef struct
+{
+    __u8    channel;
+    __u8    enable;
+    __u8    flags;      /* ETHPWM_FLAG_*, version 2 only */
+    __u32   freq;       /* Q24.8 Hz */
+    __u32   duty;       /* Q1.31 */
+} ethpwm_state_t;
+
+/* duty = value / scale for 16-bit formats, offset is not used */
+static inline __u32 ethpwm_duty16(__u16 value, __u16 scale)
+{
+    __u64 duty;
+
+    if(!scale)
+    {
+        return 0;
+    }
+    duty = ethpwm_div_u64((__u64) value << 31, scale);
+    return duty > ETHPWM_DUTY_ONE ? ETHPWM_DUTY_ONE : (__u32) duty;
+}
+
+/* Returns record size of the protocol version, 0 for unknown version */
+static inline unsigned int ethpwm_record_size(__u8 version)
+{
+    switch(version)
+    {
+        case ETHPWM_VERSION:
+            return sizeof(pwm_record_t);
+        case ETHPWM_VERSION_32:
+            return sizeof(pwm_record32_t);
+        default:
+            return 0;
+    }
+}
+
+/* Returns offset of the first record or block of the frame */
+static inline unsigned int ethpwm_records_offset(const pwm_frame_hdr_t* hdr)
+{
+    return sizeof(pwm_frame_hdr_t) + (hdr->type == ETHPWM_FRAME_PWM_AT ? sizeof(pwm_time_t) : 0);
+}
+
+/* Returns length of the extended frame in buf, which holds len bytes, or -1 for
+   unknown type or version. The frame is complete when the result is in 0..len.
+   Only stream frames are read past the header, never past len. */
+static inline int ethpwm_frame_len(const void* buf, unsigned int len)
+{
+    const pwm_frame_hdr_t* hdr = (const pwm_frame_hdr_t*) buf;
+    const pwm_stream_t* blk;
+    unsigned int rec_size, off, i;
+
+    if(len < sizeof(pwm_frame_hdr_t))
+    {
+        return sizeof(pwm_frame_hdr_t);
+    }
+    switch(hdr->type)
+    {
+        case ETHPWM_FRAME_ACK:
+            return sizeof(pwm_frame_hdr_t);
+        case ETHPWM_FRAME_SYNC:
+            return sizeof(pwm_frame_hdr_t) + sizeof(pwm_sync_t);
+        case ETHPWM_FRAME_HEARTBEAT:
+            return sizeof(pwm_frame_hdr_t) + sizeof(pwm_heartbeat_t);
+        case ETHPWM_FRAME_IO:
+            if(hdr->count > ETHPWM_MAX_IO)
+            {
+                return -1;
+            }
+            return sizeof(pwm_frame_hdr_t) + ETHPWM_IO_BYTES(hdr->count);
+        case ETHPWM_FRAME_STEP:
+        case ETHPWM_FRAME_STEP_FB:
+            if(hdr->count > ETHPWM_MAX_STEP)
+            {
+                return -1;
+            }
+            return sizeof(pwm_frame_hdr_t) + hdr->count *
+                   (hdr->type == ETHPWM_FRAME_STEP ? sizeof(pwm_step_t) : sizeof(pwm_step_fb_t));
+        case ETHPWM_FRAME_PWM:
+        case ETHPWM_FRAME_PWM_AT:
+            rec_size = ethpwm_record_size(hdr->version);
+            if(!rec_size)
+            {
+                return -1;
+            }
+            return ethpwm_records_offset(hdr) + hdr->count * rec_size;
+        case ETHPWM_FRAME_STREAM:
+            off = sizeof(pwm_frame_hdr_t);
+            for(i = 0; i < hdr->count; i++)
+            {
+                if(off + sizeof(pwm_stream_t) > len)
+                {
+                    return off + sizeof(pwm_stream_t);
+                }
+                blk = (const pwm_stream_t*) ((const __u8*) buf + off);
+                off += sizeof(pwm_stream_t) + blk->samples * sizeof(__be32);
+            }
+            return off;
+        default:
+            return -1;
+    }
+}
+
+/* 802.1Q tag control information */
+static inline __u16 ethpwm_vlan_tci(int vid, int pcp)
+{
+    return (__u16) ((pcp << 13) | (vid & 0x0fff));
+}
+
+static inline void ethpwm_init_frame(pwm_frame_hdr_t* hdr, __u32 seq, __u8 version, __u8 type, __u8 count)
+{
+    hdr->seq     = htonl(seq);
+    hdr->marker  = ETHPWM_EXT_MARKER;
+    hdr->version = version;
+    hdr->type    = type;
+    hdr->count   = count;
+}
+
+static inline void ethpwm_encode_packet(pwm_packet_t* pkt, __u32 seq, __u8 channel, __u8 enable,
+                                        __u16 value, __u16 scale, __u16 offset, __u16 freq)
+{
+    pkt->seq     = htonl(seq);
+    pkt->channel = channel;
+    pkt->enable  = enable;
+    pkt->value   = htons(value);
+    pkt->scale   = htons(scale);
+    pkt->offset  = htons(offset);
+    pkt->freq    = htons(freq);
+}
+
+static inline void ethpwm_encode_record16(pwm_record_t* rec, __u8 channel, __u8 enable,
+                                          __u16 value, __u16 scale, __u16 offset, __u16 freq)
+{
+    rec->channel = channel;
+    rec->enable  = enable;
+    rec->value   = htons(value);
+    rec->scale   = htons(scale);
+    rec->offset  = htons(offset);
+    rec->freq    = htons(freq);
+}
+
+static inline void ethpwm_encode_record32(pwm_record32_t* rec, const ethpwm_state_t* st)
+{
+    rec->channel  = st->channel;
+    rec->enable   = st->enable;
+    rec->flags    = st->flags;
+    rec->reserved = 0;
+    rec->duty     = htonl(st->duty);
+    rec->freq     = htonl(st->freq);
+}
+
+static inline void ethpwm_decode_packet(const pwm_packet_t* pkt, ethpwm_state_t* st)
+{
+    st->channel = pkt->channel;
+    st->enable  = pkt->enable;
+    st->flags   = 0;
+    st->freq    = (__u32) ntohs(pkt->freq) << ETHPWM_FREQ_SHIFT;
+    st->duty    = ethpwm_duty16(ntohs(pkt->value), ntohs(pkt->scale));
+}
+
+/* Decodes record of the protocol version, version must be known to ethpwm_record_size() */
+static inline void ethpwm_decode_record(const void* rec, __u8 version, ethpwm_state_t* st)
+{
+    const pwm_record32_t* rec32 = (const pwm_record32_t*) rec;
+    const pwm_record_t* rec16 = (const pwm_record_t*) rec;
+    __u32 duty;
+
+    if(version == ETHPWM_VERSION_32)
+    {
+        duty = ntohl(rec32->duty);
+        st->channel = rec32->channel;
+        st->enable  = rec32->enable;
+        st->flags   = rec32->flags;
+        st->freq    = ntohl(rec32->freq);
+        st->duty    = duty > ETHPWM_DUTY_ONE ? ETHPWM_DUTY_ONE : duty;
+    } else
+    {
+        st->channel = rec16->channel;
+        st->enable  = rec16->enable;
+        st->flags   = 0;
+        st->freq    = (__u32) ntohs(rec16->freq) << ETHPWM_FREQ_SHIFT;
+        st->duty    = ethpwm_duty16(ntohs(rec16->value), ntohs(rec16->scale));
+    }
+}
+
+#endif /* ETHPWM_PROTO_H */
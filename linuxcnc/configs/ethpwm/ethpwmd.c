@@ -0,0 +1,877 @@
+/* Userspace ethpwm receiver.
+ *
+ * Receives ethpwm frames on an AF_PACKET socket and drives /sys/class/pwm or
+ * a mock output with the same semantics as kernel/ethpwm_mod.c: PWM records
+ * of both versions, scheduled apply, clock sync, heartbeat watchdog and acks.
+ * Streaming, digital I/O and step generators are not supported, their frames
+ * are counted and not answered. Outputs are plain PWM: a record with the DIR
+ * or PDM flag switches its channel off and is counted as rejected.
+ * Time from frame reception (socket timestamp) to the applied state is
+ * collected into the same histogram as in the kernel module.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/types.h>
+#include <endian.h>
+
+#include "ethpwm_proto.h"
+
+#define MAX_CHANNELS            ETHPWM_EXT_MARKER
+#define SEQ_RESYNC_WINDOW       1024
+#define LATENCY_HIST_SIZE       16
+#define BUF_SIZ                 2048
+#define NSEC_PER_SEC            1000000000LL
+
+/* Received channel state with frame seq and reception time */
+typedef struct
+{
+    uint32_t    seq;
+    uint8_t     enable;
+    uint32_t    freq;       /* Q24.8 Hz */
+    uint32_t    duty;       /* Q1.31 */
+    long long   rx_time;    /* socket timestamp of the frame, CLOCK_REALTIME ns */
+} channel_data_t;
+
+typedef struct
+{
+    int             used;
+    int             init;
+    channel_data_t  data;
+    /* scheduled state, a newer one applies the older at once */
+    int             sched_valid;
+    long long       sched_at;   /* CLOCK_MONOTONIC ns */
+    channel_data_t  sched;
+    /* state written to the output */
+    unsigned long long period;
+    unsigned long long duty_cycle;
+    int             enabled;
+    /* sysfs backend */
+    int             period_fd;
+    int             duty_fd;
+    int             enable_fd;
+    /* statistics */
+    uint32_t        records;
+    uint32_t        unchanged;
+    uint32_t        applied;
+    uint32_t        rejected;       /* records with DIR or PDM flags */
+} channel_t;
+
+typedef enum
+{
+    BACKEND_MOCK,
+    BACKEND_SYSFS,
+} backend_t;
+
+static channel_t channel[MAX_CHANNELS];
+static backend_t backend = BACKEND_MOCK;
+static int verbose;
+static volatile sig_atomic_t stop;
+static volatile sig_atomic_t stats_request;
+
+static int sock;
+static int ifindex;
+/* sequence number of the last received frame */
+static uint32_t rx_seq;
+static int rx_seq_init;
+/* link loss watchdog */
+static long long watchdog_timeout;
+static long long watchdog_deadline;
+static uint32_t watchdog_timeouts;
+/* apply statistics, reported in sync replies */
+static int32_t jitter_last;
+static uint32_t jitter_max;
+static uint32_t late;
+
+static struct
+{
+    uint32_t    frames;
+    uint32_t    dropped;
+    uint32_t    lost;
+    uint32_t    reordered;
+    uint32_t    duplicate;
+    uint32_t    unsupported;    /* I/O, stream and step frames, not answered */
+    uint32_t    rejected;       /* records with DIR or PDM flags, the channel is switched off */
+    uint32_t    coalesced;      /* scheduled states applied early by a newer one */
+    uint32_t    latency_hist[LATENCY_HIST_SIZE];
+} stats;
+
+void print_usage()
+{
+    printf("Userspace ethpwm receiver.\n\n"
+           "Supported arguments:\n"
+           "--iface=IFACE      - interface to receive frames on (required)\n"
+           "--backend=NAME     - 'sysfs' drives /sys/class/pwm, 'mock' (default) only records states\n"
+           "--chip=N           - sysfs PWM chip number (default 0)\n"
+           "--channels=N       - number of channels (default: npwm of the chip for sysfs, 1 for mock)\n"
+           "--base=CH          - protocol channel of the first output (default 0)\n"
+           "--priority=N       - run with SCHED_FIFO priority N and locked memory\n"
+           "--stats=SEC        - print statistics every SEC seconds (also on SIGUSR1 and at exit)\n"
+           "--verbose          - print applied states\n");
+}
+
+static long long clock_ns(clockid_t clk)
+{
+    struct timespec ts;
+
+    clock_gettime(clk, &ts);
+    return (long long) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void on_signal(int sig)
+{
+    if(sig == SIGUSR1)
+    {
+        stats_request = 1;
+    } else
+    {
+        stop = 1;
+    }
+}
+
+static int write_attr(int fd, unsigned long long value)
+{
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%llu", value);
+
+    if(pwrite(fd, buf, len, 0) != len)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int open_attr(const char* dir, const char* name, unsigned long long* value)
+{
+    char path[256];
+    char buf[32] = {0};
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    fd = open(path, O_RDWR);
+    if(fd < 0)
+    {
+        perror(path);
+        return -1;
+    }
+    if(value && pread(fd, buf, sizeof(buf) - 1, 0) > 0)
+    {
+        *value = strtoull(buf, NULL, 10);
+    }
+    return fd;
+}
+
+/* Exports pwmN of the chip and opens its attributes */
+static int sysfs_open(int chip, int n, channel_t* ch)
+{
+    char dir[128];
+    char path[160];
+    unsigned long long enabled = 0;
+    int fd, retry;
+
+    snprintf(dir, sizeof(dir), "/sys/class/pwm/pwmchip%d/pwm%d", chip, n);
+    if(access(dir, F_OK))
+    {
+        snprintf(path, sizeof(path), "/sys/class/pwm/pwmchip%d/export", chip);
+        fd = open(path, O_WRONLY);
+        if(fd < 0 || write_attr(fd, n))
+        {
+            perror(path);
+            if(fd >= 0)
+            {
+                close(fd);
+            }
+            return -1;
+        }
+        close(fd);
+    }
+    /* udev may change permissions of the new directory */
+    for(retry = 0; retry < 100 && access(dir, W_OK); retry++)
+    {
+        usleep(10000);
+    }
+    ch->period_fd = open_attr(dir, "period", &ch->period);
+    ch->duty_fd = open_attr(dir, "duty_cycle", &ch->duty_cycle);
+    ch->enable_fd = open_attr(dir, "enable", &enabled);
+    if(ch->period_fd < 0 || ch->duty_fd < 0 || ch->enable_fd < 0)
+    {
+        return -1;
+    }
+    ch->enabled = (int) enabled;
+    return 0;
+}
+
+/* Writes only changed attributes, duty cycle never exceeds the period */
+static int sysfs_apply(channel_t* ch, unsigned long long period, unsigned long long duty_cycle, int enabled)
+{
+    int ret = 0;
+
+    if(!enabled && ch->enabled)
+    {
+        ret |= write_attr(ch->enable_fd, 0);
+    }
+    if(period != ch->period)
+    {
+        if(ch->duty_cycle > period)
+        {
+            ret |= write_attr(ch->duty_fd, 0);
+            ch->duty_cycle = 0;
+        }
+        ret |= write_attr(ch->period_fd, period);
+    }
+    if(duty_cycle != ch->duty_cycle)
+    {
+        ret |= write_attr(ch->duty_fd, duty_cycle);
+    }
+    if(enabled && !ch->enabled)
+    {
+        ret |= write_attr(ch->enable_fd, 1);
+    }
+    return ret;
+}
+
+/* Converts channel data to the output state and applies it, as update_pwm() does */
+static void apply_state(int n, long long target)
+{
+    channel_t* ch = &channel[n];
+    unsigned long long period = ch->period;
+    unsigned long long duty_cycle = ch->duty_cycle;
+    int enabled = 0;
+    long long now, jitter, latency;
+    int bucket;
+
+    ch->init = 1;
+    if(ch->data.freq)
+    {
+        period = ((unsigned long long) NSEC_PER_SEC << ETHPWM_FREQ_SHIFT) / ch->data.freq;
+        duty_cycle = (period * ch->data.duty) >> 31;
+        if(duty_cycle > period)
+        {
+            duty_cycle = period;
+        }
+        enabled = ch->data.enable;
+    }
+    if(backend == BACKEND_SYSFS && sysfs_apply(ch, period, duty_cycle, enabled))
+    {
+        fprintf(stderr, "channel %d: write failed: %s\n", n, strerror(errno));
+    }
+    ch->period = period;
+    ch->duty_cycle = duty_cycle;
+    ch->enabled = enabled;
+    ch->applied++;
+
+    if(target)
+    {
+        jitter = clock_ns(CLOCK_MONOTONIC) - target;
+        jitter = jitter > INT32_MAX ? INT32_MAX : jitter < -INT32_MAX ? -INT32_MAX : jitter;
+        jitter_last = (int32_t) jitter;
+        if((uint32_t) abs(jitter_last) > jitter_max)
+        {
+            jitter_max = (uint32_t) abs(jitter_last);
+        }
+    }
+    now = clock_ns(CLOCK_REALTIME);
+    latency = ch->data.rx_time && now > ch->data.rx_time ? (now - ch->data.rx_time) / 1000 : 0;
+    for(bucket = 0; latency && bucket < LATENCY_HIST_SIZE - 1; bucket++)
+    {
+        latency >>= 1;
+    }
+    stats.latency_hist[bucket]++;
+    if(verbose)
+    {
+        printf("channel %d: seq %u, enable %d, period %llu ns, duty_cycle %llu ns\n",
+               n, ch->data.seq, enabled, period, duty_cycle);
+    }
+}
+
+static int cmp_channel(const channel_data_t* d1, const channel_data_t* d2)
+{
+    return d1->enable != d2->enable || d1->freq != d2->freq || d1->duty != d2->duty;
+}
+
+static void rcv_channel(int n, const channel_data_t* chd, long long target)
+{
+    channel_t* ch = &channel[n];
+
+    if(!ch->init || cmp_channel(chd, &ch->data))
+    {
+        ch->data = *chd;
+        apply_state(n, target);
+    } else
+    {
+        ch->unchanged++;
+    }
+}
+
+static void rcv_channel_at(int n, const channel_data_t* chd, long long at)
+{
+    channel_t* ch = &channel[n];
+
+    if(at <= clock_ns(CLOCK_MONOTONIC))
+    {
+        late++;
+    }
+    if(ch->sched_valid)
+    {
+        /* a newer state arrived, the pending one is applied now */
+        stats.coalesced++;
+        rcv_channel(n, &ch->sched, ch->sched_at);
+    }
+    ch->sched = *chd;
+    ch->sched_at = at;
+    ch->sched_valid = 1;
+}
+
+/* Applies scheduled states which are due, returns time of the next one or 0 */
+static long long apply_scheduled(long long now)
+{
+    long long next = 0;
+    int n;
+
+    for(n = 0; n < MAX_CHANNELS; n++)
+    {
+        if(!channel[n].sched_valid)
+        {
+            continue;
+        }
+        if(channel[n].sched_at <= now)
+        {
+            channel[n].sched_valid = 0;
+            rcv_channel(n, &channel[n].sched, channel[n].sched_at);
+        } else if(!next || channel[n].sched_at < next)
+        {
+            next = channel[n].sched_at;
+        }
+    }
+    return next;
+}
+
+/* No frames from the host within the timeout, switch all outputs off */
+static void watchdog_expired(void)
+{
+    int n;
+
+    watchdog_timeouts++;
+    fprintf(stderr, "host timeout, outputs are switched off\n");
+    for(n = 0; n < MAX_CHANNELS; n++)
+    {
+        if(channel[n].used)
+        {
+            channel[n].sched_valid = 0;
+            channel[n].data.enable = 0;
+            channel[n].data.rx_time = 0;
+            apply_state(n, 0);
+        }
+    }
+}
+
+/* Returns 0 for a duplicate or reordered frame, 1 for a newer one */
+static int check_seq(uint32_t seq)
+{
+    int32_t diff = (int32_t) (seq - rx_seq - 1);
+
+    if(!rx_seq_init || diff < -SEQ_RESYNC_WINDOW || diff > SEQ_RESYNC_WINDOW)
+    {
+        rx_seq = seq;
+        rx_seq_init = 1;
+        return 1;
+    }
+    if(diff == -1)
+    {
+        stats.duplicate++;
+        return 0;
+    }
+    if(diff < 0)
+    {
+        stats.reordered++;
+        return 0;
+    }
+    stats.lost += diff;
+    rx_seq = seq;
+    return 1;
+}
+
+static void feed_watchdog(long long rx_mono)
+{
+    if(watchdog_timeout)
+    {
+        watchdog_deadline = rx_mono + watchdog_timeout;
+    }
+}
+
+static void send_reply(const struct sockaddr_ll* to, const pwm_frame_hdr_t* rx_hdr, uint8_t type,
+                       uint8_t count, const void* payload, unsigned int len)
+{
+    unsigned char buf[BUF_SIZ];
+    pwm_frame_hdr_t* hdr = (pwm_frame_hdr_t*) buf;
+    struct sockaddr_ll addr = *to;
+
+    hdr->seq = rx_hdr->seq;
+    hdr->marker = ETHPWM_EXT_MARKER;
+    hdr->version = rx_hdr->version;
+    hdr->type = type;
+    hdr->count = count;
+    if(len)
+    {
+        memcpy(hdr + 1, payload, len);
+    }
+    addr.sll_protocol = htons(ETHPWM_ETHERTYPE);
+    addr.sll_ifindex = ifindex;
+    sendto(sock, buf, sizeof(pwm_frame_hdr_t) + len, 0, (struct sockaddr*) &addr, sizeof(addr));
+}
+
+static int rcv_frame(const unsigned char* buf, size_t len, const struct sockaddr_ll* from,
+                     long long rx_time, long long rx_mono)
+{
+    const pwm_frame_hdr_t* hdr = (const pwm_frame_hdr_t*) buf;
+    const unsigned char* rec;
+    channel_data_t chd;
+    ethpwm_state_t st;
+    pwm_sync_t sync;
+    pwm_heartbeat_t hb;
+    size_t rec_size;
+    long long at = 0;
+    uint32_t seq;
+    int i, needed;
+
+    needed = ethpwm_frame_len(buf, len);
+    if(needed < 0 || (size_t) needed > len || !ethpwm_record_size(hdr->version))
+    {
+        return -1;
+    }
+    switch(hdr->type)
+    {
+        case ETHPWM_FRAME_ACK:
+            break;
+        case ETHPWM_FRAME_PWM_AT:
+        case ETHPWM_FRAME_PWM:
+        case ETHPWM_FRAME_STREAM:
+            /* a duplicate or stale frame does not prove the host is alive */
+            if(check_seq(ntohl(hdr->seq)))
+            {
+                feed_watchdog(rx_mono);
+            }
+            break;
+        default:
+            feed_watchdog(rx_mono);
+            break;
+    }
+    switch(hdr->type)
+    {
+        case ETHPWM_FRAME_ACK:
+            /* ack from another receiver */
+            return 0;
+        case ETHPWM_FRAME_SYNC:
+            memcpy(&sync, hdr + 1, sizeof(pwm_sync_t));
+            sync.t2 = htobe64((uint64_t) rx_mono);
+            sync.jitter_last = htonl((uint32_t) jitter_last);
+            sync.jitter_max = htonl(jitter_max);
+            sync.late = htonl(late);
+            sync.stream_underrun = 0;
+            sync.stream_overrun = 0;
+            sync.t3 = htobe64((uint64_t) clock_ns(CLOCK_MONOTONIC));
+            send_reply(from, hdr, ETHPWM_FRAME_SYNC, 0, &sync, sizeof(pwm_sync_t));
+            return 0;
+        case ETHPWM_FRAME_HEARTBEAT:
+            memcpy(&hb, hdr + 1, sizeof(pwm_heartbeat_t));
+            watchdog_timeout = ntohl(hb.timeout);
+            watchdog_deadline = watchdog_timeout ? rx_mono + watchdog_timeout : 0;
+            hb.timeouts = htonl(watchdog_timeouts);
+            send_reply(from, hdr, ETHPWM_FRAME_HEARTBEAT, 0, &hb, sizeof(pwm_heartbeat_t));
+            return 0;
+        case ETHPWM_FRAME_IO:
+            /* no digital I/O. No reply, so the host keeps in-valid false */
+            stats.unsupported++;
+            return 0;
+        case ETHPWM_FRAME_STREAM:
+            /* samples are not played, so they are not acked: the host counts them as lost */
+            stats.unsupported++;
+            return 0;
+        case ETHPWM_FRAME_STEP:
+            /* no step generators, host sees no position feedback */
+            stats.unsupported++;
+            return 0;
+        case ETHPWM_FRAME_PWM_AT:
+        case ETHPWM_FRAME_PWM:
+            break;
+        default:
+            return -1;
+    }
+    rec_size = ethpwm_record_size(hdr->version);
+    rec = buf + ethpwm_records_offset(hdr);
+    seq = ntohl(hdr->seq);
+    if(hdr->type == ETHPWM_FRAME_PWM_AT)
+    {
+        at = (long long) be64toh(((const pwm_time_t*) (hdr + 1))->time);
+    }
+
+    for(i = 0; i < hdr->count; i++, rec += rec_size)
+    {
+        /* channel is the first byte of any record */
+        if(rec[0] >= MAX_CHANNELS || !channel[rec[0]].used)
+        {
+            continue;
+        }
+        ethpwm_decode_record(rec, hdr->version, &st);
+        chd.seq = seq;
+        chd.enable = st.enable;
+        if(st.flags & (ETHPWM_FLAG_DIR | ETHPWM_FLAG_PDM))
+        {
+            /* no direction output or PDM, the old duty cycle may be for the other direction */
+            chd.enable = 0;
+            channel[rec[0]].rejected++;
+            stats.rejected++;
+        }
+        chd.freq = st.freq;
+        chd.duty = st.duty;
+        chd.rx_time = rx_time;
+        channel[rec[0]].records++;
+        if(hdr->type == ETHPWM_FRAME_PWM_AT)
+        {
+            rcv_channel_at(rec[0], &chd, at);
+        } else
+        {
+            rcv_channel(rec[0], &chd, 0);
+        }
+    }
+    send_reply(from, hdr, ETHPWM_FRAME_ACK, 0, NULL, 0);
+    return 0;
+}
+
+static int rcv_packet(const unsigned char* buf, size_t len, const struct sockaddr_ll* from,
+                      long long rx_time, long long rx_mono)
+{
+    const pwm_packet_t* pkt = (const pwm_packet_t*) buf;
+    channel_data_t chd;
+    ethpwm_state_t st;
+
+    stats.frames++;
+    if(len < sizeof(pwm_frame_hdr_t))
+    {
+        return -1;
+    }
+    if(pkt->channel == ETHPWM_EXT_MARKER)
+    {
+        return rcv_frame(buf, len, from, rx_time, rx_mono);
+    }
+    if(len < sizeof(pwm_packet_t))
+    {
+        return -1;
+    }
+    if(check_seq(ntohl(pkt->seq)))
+    {
+        feed_watchdog(rx_mono);
+    }
+    if(pkt->channel >= MAX_CHANNELS || !channel[pkt->channel].used)
+    {
+        return 0;
+    }
+    ethpwm_decode_packet(pkt, &st);
+    chd.seq = ntohl(pkt->seq);
+    chd.enable = st.enable;
+    chd.freq = st.freq;
+    chd.duty = st.duty;
+    chd.rx_time = rx_time;
+    channel[pkt->channel].records++;
+    rcv_channel(pkt->channel, &chd, 0);
+    return 0;
+}
+
+static void print_stats(void)
+{
+    int i;
+
+    printf("frames: %u\ndropped: %u\nlost: %u\nreordered: %u\nduplicate: %u\n"
+           "unsupported: %u\nrejected: %u\ncoalesced: %u\nwatchdog_timeouts: %u\n",
+           stats.frames, stats.dropped, stats.lost, stats.reordered, stats.duplicate,
+           stats.unsupported, stats.rejected, stats.coalesced, watchdog_timeouts);
+    for(i = 0; i < MAX_CHANNELS; i++)
+    {
+        if(channel[i].used)
+        {
+            printf("ch%d: records %u, unchanged %u, applied %u, rejected %u\n",
+                   i, channel[i].records, channel[i].unchanged, channel[i].applied, channel[i].rejected);
+        }
+    }
+    printf("latency_us count\n");
+    for(i = 0; i < LATENCY_HIST_SIZE - 1; i++)
+    {
+        printf("<%u %u\n", 1u << i, stats.latency_hist[i]);
+    }
+    printf(">=%u %u\n", 1u << (LATENCY_HIST_SIZE - 2), stats.latency_hist[LATENCY_HIST_SIZE - 1]);
+    fflush(stdout);
+}
+
+static int open_socket(const char* iface)
+{
+    struct sockaddr_ll addr = {0};
+    int on = 1;
+
+    sock = socket(AF_PACKET, SOCK_DGRAM, htons(ETHPWM_ETHERTYPE));
+    if(sock < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    ifindex = if_nametoindex(iface);
+    if(!ifindex)
+    {
+        perror(iface);
+        return -1;
+    }
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETHPWM_ETHERTYPE);
+    addr.sll_ifindex = ifindex;
+    if(bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0)
+    {
+        perror("bind");
+        return -1;
+    }
+    /* reception time for latency statistics */
+    if(setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0)
+    {
+        perror("SO_TIMESTAMPNS");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    char ifName[IFNAMSIZ] = {0};
+    unsigned char buf[BUF_SIZ];
+    char ctrl[CMSG_SPACE(sizeof(struct timespec))];
+    struct sockaddr_ll from;
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct pollfd pfd;
+    struct timespec ts;
+    struct sigaction sa;
+    int chip = 0, channels = -1, base = 0, priority = 0, stats_interval = 0;
+    long long rx_time, rx_mono, now, next, deadline, stats_time;
+    unsigned long long npwm;
+    ssize_t len;
+    int c, option_index, fd, i;
+    struct option long_options[] = {
+            {"iface",       required_argument,  0, 'i'},
+            {"backend",     required_argument,  0, 'b'},
+            {"chip",        required_argument,  0, 'c'},
+            {"channels",    required_argument,  0, 'n'},
+            {"base",        required_argument,  0, 'B'},
+            {"priority",    required_argument,  0, 'p'},
+            {"stats",       required_argument,  0, 's'},
+            {"verbose",     no_argument,        0, 'v'},
+            {"help",        no_argument,        0, 'h'},
+            {0,             0,                  0, 0}
+    };
+
+    while((c = getopt_long(argc, argv, "i:b:c:n:B:p:s:vh", long_options, &option_index)) != -1)
+    {
+        switch (c)
+        {
+            case 'i':
+                if(strlen(optarg) > IFNAMSIZ - 1)
+                {
+                    printf("Interface name is too long\n");
+                    exit(EXIT_FAILURE);
+                }
+                strcpy(ifName, optarg);
+                break;
+            case 'b':
+                if(!strcmp(optarg, "sysfs"))
+                {
+                    backend = BACKEND_SYSFS;
+                } else if(!strcmp(optarg, "mock"))
+                {
+                    backend = BACKEND_MOCK;
+                } else
+                {
+                    printf("backend can be sysfs or mock\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                chip = atoi(optarg);
+                break;
+            case 'n':
+                channels = atoi(optarg);
+                break;
+            case 'B':
+                base = atoi(optarg);
+                break;
+            case 'p':
+                priority = atoi(optarg);
+                break;
+            case 's':
+                stats_interval = atoi(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'h':
+            case '?':
+                print_usage();
+                exit(EXIT_SUCCESS);
+            default:
+                printf("?? getopt returned character code 0%o ??\n", c);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(!ifName[0])
+    {
+        printf("ERROR: Argument 'iface' is required\n\n\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if(channels < 0)
+    {
+        channels = 1;
+        if(backend == BACKEND_SYSFS)
+        {
+            snprintf((char*) buf, sizeof(buf), "/sys/class/pwm/pwmchip%d", chip);
+            fd = open_attr((char*) buf, "npwm", &npwm);
+            if(fd < 0)
+            {
+                exit(EXIT_FAILURE);
+            }
+            close(fd);
+            channels = (int) npwm;
+        }
+    }
+    if(base < 0 || channels < 1 || base + channels > MAX_CHANNELS)
+    {
+        printf("channels %d..%d are out of range 0..%d\n", base, base + channels - 1, MAX_CHANNELS - 1);
+        exit(EXIT_FAILURE);
+    }
+    for(i = 0; i < channels; i++)
+    {
+        channel[base + i].used = 1;
+        if(backend == BACKEND_SYSFS && sysfs_open(chip, i, &channel[base + i]))
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(open_socket(ifName))
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    if(priority)
+    {
+        struct sched_param sp = { .sched_priority = priority };
+
+        if(sched_setscheduler(0, SCHED_FIFO, &sp) || mlockall(MCL_CURRENT | MCL_FUTURE))
+        {
+            perror("SCHED_FIFO");
+        }
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    printf("ethpwmd: %s backend, channels %d..%d on %s\n",
+           backend == BACKEND_SYSFS ? "sysfs" : "mock", base, base + channels - 1, ifName);
+    fflush(stdout);
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    next = 0;
+    stats_time = clock_ns(CLOCK_MONOTONIC) + (long long) stats_interval * NSEC_PER_SEC;
+    while(!stop)
+    {
+        /* sleep until a frame, the next scheduled state, watchdog timeout or statistics */
+        deadline = next;
+        if(watchdog_deadline && (!deadline || watchdog_deadline < deadline))
+        {
+            deadline = watchdog_deadline;
+        }
+        if(stats_interval && (!deadline || stats_time < deadline))
+        {
+            deadline = stats_time;
+        }
+        if(deadline)
+        {
+            now = clock_ns(CLOCK_MONOTONIC);
+            deadline = deadline > now ? deadline - now : 0;
+            ts.tv_sec = deadline / NSEC_PER_SEC;
+            ts.tv_nsec = deadline % NSEC_PER_SEC;
+        }
+        if(ppoll(&pfd, 1, deadline ? &ts : NULL, NULL) > 0)
+        {
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_name = &from;
+            msg.msg_namelen = sizeof(from);
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = ctrl;
+            msg.msg_controllen = sizeof(ctrl);
+            len = recvmsg(sock, &msg, MSG_DONTWAIT);
+            rx_mono = clock_ns(CLOCK_MONOTONIC);
+            if(len >= 0 && from.sll_pkttype != PACKET_OUTGOING && from.sll_pkttype != PACKET_OTHERHOST)
+            {
+                rx_time = 0;
+                for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+                {
+                    if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+                    {
+                        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                        rx_time = (long long) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+                    }
+                }
+                if(rcv_packet(buf, (size_t) len, &from, rx_time, rx_mono))
+                {
+                    stats.dropped++;
+                }
+            }
+        }
+        now = clock_ns(CLOCK_MONOTONIC);
+        next = apply_scheduled(now);
+        if(watchdog_deadline && now >= watchdog_deadline)
+        {
+            watchdog_deadline = 0;
+            watchdog_expired();
+        }
+        if(stats_interval && now >= stats_time)
+        {
+            stats_request = 1;
+            stats_time = now + (long long) stats_interval * NSEC_PER_SEC;
+        }
+        if(stats_request)
+        {
+            stats_request = 0;
+            print_stats();
+        }
+    }
+
+    /* switch outputs off */
+    for(i = 0; i < MAX_CHANNELS; i++)
+    {
+        if(channel[i].used && backend == BACKEND_SYSFS && channel[i].enabled)
+        {
+            write_attr(channel[i].enable_fd, 0);
+        }
+    }
+    print_stats();
+    close(sock);
+    return 0;
+}
@@ -12,115 +12,1232 @@
 #include <linux/device.h>
 #include <linux/math64.h>
 #include <linux/workqueue.h>
+#include <linux/etherdevice.h>
+#include <linux/if_vlan.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/gpio/consumer.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "ethpwm_proto.h"
 
 /*#define PWM_DEBUG*/
 #define LOG_PREFIX      "ethpwm: "
 
+#define SCHED_QUEUE_SIZE        8       /* scheduled updates per channel, power of 2 */
+#define STREAM_FIFO_SIZE        256     /* buffered duty samples per channel, power of 2 */
+#define STREAM_PREFILL          2       /* playback starts when this number of blocks is buffered */
+#define STREAM_MIN_PERIOD       20000   /* ns, min sample period of stream playback */
+#define SEQ_RESYNC_WINDOW       1024    /* larger seq jump restarts the sequence, e.g. after host restart */
+#define SOFT_MIN_PERIOD         20000   /* ns, max 50 kHz PWM or PDM rate of GPIO channels */
+#define LATENCY_HIST_SIZE       16      /* apply latency buckets: < 1 us, < 2 us, < 4 us .. >= 16 ms */
+#define STEP_MIN_PERIOD         20000   /* ns, max 50 kHz step rate of step generators */
+#define STEP_MIN_LEN            1000    /* ns, min step pulse length */
+#define STEP_POLL_PERIOD        100000  /* ns, max sleep of step_timer, so a new target takes effect soon */
+#define STEP_TIMEOUT_PERIODS    2       /* velocity mode stops after this number of periods without a step frame */
+#define STEP_RAMP_SHIFT         2       /* position mode step rate grows by up to 1/4 and one step per period */
 
-typedef struct __attribute__((packed))
-{
-    __be32  seq;
-    __u8    channel;
-    __u8    enable;
-    __be16  value;
-    __be16  scale;
-    __be16  offset;
-    __be16  freq;
-} pwm_packet_t;
-
-
+/* Received channel state with frame seq and reception time */
 struct channel_data
 {
     uint32_t            seq;
     uint8_t             enable;
-    uint16_t            freq;
-    uint16_t            scale;
-    uint16_t            offset;
-    uint16_t            value;
+    uint32_t            freq;       /* Q24.8 Hz */
+    uint32_t            duty;       /* Q1.31 */
+    uint8_t             flags;      /* ETHPWM_FLAG_* */
+    ktime_t             rx_time;    /* reception time of the frame */
+};
+
+/* Channel state waiting for its apply time */
+struct sched_state
+{
+    ktime_t             at;
+    struct channel_data data;
 };
 
-struct pwm_work
+/* Output backend of a channel */
+enum channel_type
 {
-    struct work_struct work;
-    struct pwm_state   state;
-    struct pwm_device* pwm;
+    CHANNEL_PWM,        /* hardware PWM from pwms */
+    CHANNEL_SOFT_PWM,   /* PWM on a GPIO from pwm-gpios, generated by hrtimer */
+    CHANNEL_SOFT_PDM,   /* pulse density modulation on a GPIO, one bit per period */
 };
 
+/* One PWM output */
 struct ethpwm_data
 {
+    enum channel_type   type;
     struct pwm_device*  pwm;
-    uint8_t             channel;
+    /* GPIO channels: soft_timer toggles gpio by period and duty of the applied state */
+    struct gpio_desc*   gpio;
+    spinlock_t          soft_lock;
+    struct hrtimer      soft_timer;
+    uint64_t            soft_period;    /* ns */
+    uint64_t            soft_duty;      /* ns */
+    uint32_t            soft_density;   /* PDM duty, Q1.31 */
+    uint32_t            soft_acc;       /* PDM error accumulator, Q1.31 */
+    uint8_t             soft_enabled;
+    uint8_t             soft_level;
+    uint8_t             soft_running;
+    uint8_t             soft_pdm;       /* PDM by pwm-gpio-modes or by the PDM flag of the state */
+    /* optional direction output from pwm-dir-gpios, driven by the DIR flag */
+    struct gpio_desc*   dir_gpio;
+    uint8_t             out_flags;      /* flags of the applied state */
+    uint8_t             channel;    /* channel number in the protocol */
     uint8_t             init;
     struct channel_data data;
     struct pwm_state    state;
     struct workqueue_struct* wq;
+    /* the latest state wins: update_pwm overwrites it, apply_work applies the newest one.
+       apply_lock also protects init, data and state, which are updated from softirq and hrtimers */
+    spinlock_t          apply_lock;
+    struct work_struct  apply_work;
+    struct pwm_state    pending;
+    uint8_t             pending_flags;
+    s64                 pending_target; /* scheduled apply time, 0 - not scheduled */
+    ktime_t             pending_rx;     /* reception time of the pending state */
+    uint8_t             pending_valid;
+    uint32_t            applied;        /* states passed to the PWM driver */
+    uint32_t            coalesced;      /* states replaced by a newer one before being applied */
+    uint32_t            latency_hist[LATENCY_HIST_SIZE];    /* reception to apply time */
+    uint32_t            records;        /* records and stream blocks received for the channel */
+    uint32_t            unchanged;      /* records skipped as equal to the current state */
+    struct dentry*      debugfs;
+    /* scheduled updates, ordered by arrival. apply_timer expires at the oldest one */
+    spinlock_t          sched_lock;
+    struct hrtimer      apply_timer;
+    struct sched_state  sched[SCHED_QUEUE_SIZE];
+    unsigned int        sched_head;
+    unsigned int        sched_tail;
+    /* apply time statistics, reported in sync replies */
+    int32_t             jitter_last;
+    uint32_t            jitter_max;
+    uint32_t            late;
+    /* streaming mode. Samples are played by stream_timer, which applies them to GPIO
+       channels directly and to hardware PWM through stream_work */
+    spinlock_t          stream_lock;
+    struct hrtimer      stream_timer;
+    struct work_struct  stream_work;
+    uint32_t            stream_fifo[STREAM_FIFO_SIZE];
+    unsigned int        stream_head;
+    unsigned int        stream_tail;
+    unsigned int        stream_block;   /* samples in the last received block */
+    uint32_t            sample_period;  /* ns */
+    uint32_t            stream_freq;    /* Q24.8 Hz */
+    uint8_t             stream_enable;
+    uint8_t             stream_flags;
+    uint8_t             stream_playing;
+    uint32_t            stream_duty;    /* sample to apply, Q1.31 */
+    uint32_t            underrun;
+    uint32_t            overrun;
+    uint32_t            skipped;        /* samples replaced before stream_work applied them */
 };
 
-/* Function for work */
-static void update_pwm_work(struct work_struct *work)
+/* Step/dir generator on GPIOs, step_timer makes steps toward the target of the last step frame */
+struct ethpwm_stepgen
+{
+    struct gpio_desc*   step_gpio;
+    struct gpio_desc*   dir_gpio;
+    spinlock_t          lock;
+    struct hrtimer      timer;
+    int64_t             target;     /* position mode: Q48.16 steps */
+    int64_t             position;   /* generated steps */
+    uint64_t            interval;   /* ns between steps at the commanded rate */
+    s64                 last;       /* ns, falling edge of the last step, dir_hold counts from it */
+    s64                 last_rise;  /* ns, rising edge of the last step, interval counts from it */
+    s64                 pulse_end;  /* ns, the earliest falling edge of the current step */
+    s64                 ready;      /* ns, the earliest time of the next step */
+    s64                 deadline;   /* ns, velocity mode stops at this time without a new step frame */
+    uint64_t            rate;       /* position mode: Q48.16 steps per period of the last target */
+    uint32_t            step_len;   /* ns */
+    uint32_t            dir_hold;   /* ns */
+    uint32_t            dir_setup;  /* ns */
+    int8_t              dir;        /* direction of the dir output, 1 or -1 */
+    int8_t              vel_dir;    /* velocity mode: commanded direction, 0 - stop */
+    uint8_t             mode;
+    uint8_t             enable;
+    uint8_t             step_level;
+    uint8_t             running;
+};
+
+/* Device tree node: PWM outputs listed in pwms and optional digital I/O and step generators */
+struct ethpwm_device
+{
+    struct ethpwm_data* channels;
+    unsigned int        num_channels;
+    struct gpio_descs*  pwm_gpios;
+    /* remote digital I/O, in-gpios and out-gpios of the device tree node */
+    struct gpio_descs*  in_gpios;
+    struct gpio_descs*  out_gpios;
+    /* step generators, step-gpios and dir-gpios of the device tree node */
+    struct ethpwm_stepgen* stepgens;
+    unsigned int        num_stepgens;
+};
+
+/* Channels of all devices by protocol channel number. The packet handler
+   reads it under RCU, probe and remove update it under channel_map_lock */
+static struct ethpwm_data __rcu* channel_map[ETHPWM_EXT_MARKER];
+/* Device which handles I/O frames */
+static struct ethpwm_device __rcu* io_device;
+/* Device which handles step frames */
+static struct ethpwm_device __rcu* step_device;
+static DEFINE_MUTEX(channel_map_lock);
+/* sequence number of the last received frame */
+static uint32_t rx_seq;
+static uint8_t rx_seq_init;
+/* Frame statistics of the protocol handler */
+static struct
+{
+    uint32_t    frames;     /* frames and legacy packets received */
+    uint32_t    dropped;    /* malformed frames */
+    uint32_t    lost;       /* frames missing in seq sequence */
+    uint32_t    reordered;  /* frames received after a newer one */
+    uint32_t    duplicate;  /* frames with seq of the previous one */
+} rx_stats;
+
+/* Link loss watchdog, restarted by every frame from the host once a heartbeat set its timeout */
+static struct hrtimer watchdog_timer;
+static ktime_t watchdog_timeout;
+static uint32_t watchdog_timeouts;
+
+/* 802.1Q tagging and priority of replies, the host tags its frames the same way */
+static int vlan = -1;
+module_param(vlan, int, 0444);
+MODULE_PARM_DESC(vlan, "802.1Q VLAN id of replies, 0 - priority tag only, -1 - untagged");
+static int pcp;
+module_param(pcp, int, 0444);
+MODULE_PARM_DESC(pcp, "802.1Q priority code point (0..7) of tagged replies");
+static int tx_priority;
+module_param(tx_priority, int, 0444);
+MODULE_PARM_DESC(tx_priority, "Priority of replies, selects traffic class of mqprio/taprio");
+
+static inline struct ethpwm_data* find_channel(uint8_t channel)
+{
+    return channel < ETHPWM_EXT_MARKER ? rcu_dereference(channel_map[channel]) : NULL;
+}
+
+static struct dentry* debugfs_root;
+
+/* Generates the output of a GPIO channel, runs while the channel is enabled */
+static enum hrtimer_restart soft_timer_fn(struct hrtimer* timer)
+{
+    struct ethpwm_data* priv = container_of(timer, struct ethpwm_data, soft_timer);
+    unsigned long flags;
+    uint64_t next;
+    uint8_t level;
+
+    spin_lock_irqsave(&priv->soft_lock, flags);
+    if(!priv->soft_enabled)
+    {
+        gpiod_set_value(priv->gpio, 0);
+        priv->soft_level = 0;
+        priv->soft_running = 0;
+        spin_unlock_irqrestore(&priv->soft_lock, flags);
+        return HRTIMER_NORESTART;
+    }
+    next = priv->soft_period;
+    if(priv->soft_pdm)
+    {
+        /* first order sigma-delta: output 1 when accumulated duty reaches 1.0 */
+        priv->soft_acc += priv->soft_density;
+        level = priv->soft_acc >= ETHPWM_DUTY_ONE;
+        if(level)
+        {
+            priv->soft_acc -= ETHPWM_DUTY_ONE;
+        }
+    } else if(!priv->soft_duty || priv->soft_duty >= priv->soft_period)
+    {
+        level = priv->soft_duty != 0;
+    } else if(!priv->soft_level)
+    {
+        level = 1;
+        next = priv->soft_duty;
+    } else
+    {
+        level = 0;
+        next = priv->soft_period - priv->soft_duty;
+    }
+    gpiod_set_value(priv->gpio, level);
+    priv->soft_level = level;
+    spin_unlock_irqrestore(&priv->soft_lock, flags);
+
+    hrtimer_forward_now(timer, ns_to_ktime(next));
+    return HRTIMER_RESTART;
+}
+
+/* Passes state to the GPIO generator, new period and duty take effect at the next edge */
+static void soft_apply_state(struct ethpwm_data* priv, const struct pwm_state* state, uint8_t pdm)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&priv->soft_lock, flags);
+    priv->soft_pdm = priv->type == CHANNEL_SOFT_PDM || pdm;
+    priv->soft_period = max_t(uint64_t, state->period, SOFT_MIN_PERIOD);
+    priv->soft_duty = min_t(uint64_t, state->duty_cycle, priv->soft_period);
+    priv->soft_density = state->period ? (uint32_t) min_t(uint64_t,
+            div64_u64((uint64_t) state->duty_cycle << 31, state->period), ETHPWM_DUTY_ONE) : 0;
+    priv->soft_enabled = state->enabled && state->period;
+    if(priv->soft_enabled && !priv->soft_running)
+    {
+        priv->soft_running = 1;
+        priv->soft_acc = 0;
+        hrtimer_start(&priv->soft_timer, 0, HRTIMER_MODE_REL);
+    }
+    spin_unlock_irqrestore(&priv->soft_lock, flags);
+}
+
+/* Applies state to the output of any channel type, may sleep for hardware PWM only. The
+   direction output is set before the duty, PDM flag is ignored by hardware PWM channels */
+static void apply_state(struct ethpwm_data* priv, const struct pwm_state* state, uint8_t out_flags)
+{
+    if(priv->dir_gpio)
+    {
+        gpiod_set_value(priv->dir_gpio, !!(out_flags & ETHPWM_FLAG_DIR));
+    }
+    priv->out_flags = out_flags;
+    if(priv->type == CHANNEL_PWM)
+    {
+        pwm_apply_state(priv->pwm, state);
+    } else
+    {
+        soft_apply_state(priv, state, out_flags & ETHPWM_FLAG_PDM);
+    }
+}
+
+/* Applies the newest pending state of the channel */
+static void apply_work_fn(struct work_struct *work)
+{
+    struct ethpwm_data* priv = container_of(work, struct ethpwm_data, apply_work);
+    struct pwm_state state;
+    unsigned long flags;
+    ktime_t rx_time;
+    s64 target, now, jitter;
+    uint64_t latency;
+    int bucket;
+    uint8_t out_flags;
+
+    spin_lock_irqsave(&priv->apply_lock, flags);
+    if(!priv->pending_valid)
+    {
+        spin_unlock_irqrestore(&priv->apply_lock, flags);
+        return;
+    }
+    state = priv->pending;
+    out_flags = priv->pending_flags;
+    target = priv->pending_target;
+    rx_time = priv->pending_rx;
+    priv->pending_valid = 0;
+    spin_unlock_irqrestore(&priv->apply_lock, flags);
+
+    /* time when the state is passed to the PWM driver */
+    now = ktime_to_ns(ktime_get());
+    if(target)
+    {
+        jitter = now - target;
+        jitter = clamp_t(s64, jitter, -S32_MAX, S32_MAX);
+        priv->jitter_last = (int32_t) jitter;
+        if((uint32_t) abs(priv->jitter_last) > priv->jitter_max)
+        {
+            priv->jitter_max = (uint32_t) abs(priv->jitter_last);
+        }
+    }
+    latency = div_u64((uint64_t) max_t(s64, now - ktime_to_ns(rx_time), 0), NSEC_PER_USEC);
+    bucket = fls((uint32_t) min_t(uint64_t, latency, U32_MAX));
+    priv->latency_hist[min(bucket, LATENCY_HIST_SIZE - 1)]++;
+    priv->applied++;
+
+    apply_state(priv, &state, out_flags);
+}
+
+static inline pwm_packet_t *ethpwm_hdr(const struct sk_buff *skb)
+{
+	return (pwm_packet_t*) skb_network_header(skb);
+}
+
+static inline int cmp_channel(const struct channel_data* d1, const struct channel_data* d2)
+{
+    if(d1->enable != d2->enable ||
+       d1->freq   != d2->freq ||
+       d1->duty   != d2->duty ||
+       d1->flags  != d2->flags)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+static inline void set_channel_data(uint32_t seq, const ethpwm_state_t* st, struct channel_data* data)
+{
+    data->seq    = seq;
+    data->enable = st->enable;
+    data->freq   = st->freq;
+    data->duty   = st->duty;
+    data->flags  = st->flags;
+}
+
+/* Sets new channel data and passes its state to apply_work, a state not applied yet is
+   replaced. Data equal to the current one is skipped. Called from softirq and hrtimers */
+static void update_pwm(struct ethpwm_data* priv, const struct channel_data* chd, s64 target)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&priv->apply_lock, flags);
+    if(priv->init && !cmp_channel(chd, &priv->data))
+    {
+        priv->unchanged++;
+        spin_unlock_irqrestore(&priv->apply_lock, flags);
+        return;
+    }
+    priv->init = 1;
+    priv->data = *chd;
+    if(priv->data.freq)
+    {
+        priv->state.period = div_u64((uint64_t) NSEC_PER_SEC << ETHPWM_FREQ_SHIFT, priv->data.freq);
+        priv->state.duty_cycle = mul_u64_u32_shr(priv->state.period, priv->data.duty, 31);
+        if(priv->state.duty_cycle > priv->state.period)
+        {
+            priv->state.duty_cycle = priv->state.period;
+        }
+        priv->state.enabled = priv->data.enable;
+    } else
+    {
+        /* zero frequency, keep the last period and switch output off */
+        priv->state.enabled = 0;
+    }
+
+#ifdef PWM_DEBUG
+    printk(KERN_INFO LOG_PREFIX "PWM period: %u, duty_cycle: %u, polarity: %d\n", (unsigned int) priv->state.period, (unsigned int) priv->state.duty_cycle, priv->state.polarity);
+#endif
+    if(priv->pending_valid)
+    {
+        priv->coalesced++;
+    }
+    priv->pending = priv->state;
+    priv->pending_flags = priv->data.flags;
+    priv->pending_target = target;
+    priv->pending_rx = priv->data.rx_time;
+    priv->pending_valid = 1;
+    spin_unlock_irqrestore(&priv->apply_lock, flags);
+    queue_work(priv->wq, &priv->apply_work);
+}
+
+/* Counts lost, reordered and duplicate frames by seq. Returns 0 for a duplicate or
+   reordered frame, 1 for a newer one */
+static int check_seq(uint32_t seq)
+{
+    int32_t diff = (int32_t) (seq - rx_seq - 1);
+
+    if(!rx_seq_init || diff < -SEQ_RESYNC_WINDOW || diff > SEQ_RESYNC_WINDOW)
+    {
+        if(rx_seq_init)
+        {
+            printk_ratelimited(KERN_INFO LOG_PREFIX "sequence restarted, last_seq: %u, seq %u\n", rx_seq, seq);
+        }
+        rx_seq = seq;
+        rx_seq_init = 1;
+        return 1;
+    }
+    if(diff == -1)
+    {
+        rx_stats.duplicate++;
+        return 0;
+    }
+    if(diff < 0)
+    {
+        rx_stats.reordered++;
+        printk_ratelimited(KERN_WARNING LOG_PREFIX "reordered packet last_seq: %u, seq %u\n", rx_seq, seq);
+        return 0;
+    }
+    if(diff > 0)
+    {
+        rx_stats.lost += diff;
+        printk_ratelimited(KERN_WARNING LOG_PREFIX "%d packets lost, last_seq: %u, seq %u\n", diff, rx_seq, seq);
+    }
+    rx_seq = seq;
+    return 1;
+}
+
+static void rcv_channel(struct ethpwm_data* priv, const struct channel_data* chd)
+{
+    priv->records++;
+    update_pwm(priv, chd, 0);
+}
+
+/* Applies all scheduled updates which are due, called with sched_lock held.
+   Returns apply time of the next update or 0 if nothing is scheduled. */
+static ktime_t apply_scheduled(struct ethpwm_data* priv, ktime_t now)
+{
+    struct sched_state* st;
+
+    while(priv->sched_tail != priv->sched_head)
+    {
+        st = &priv->sched[priv->sched_tail & (SCHED_QUEUE_SIZE - 1)];
+        if(ktime_after(st->at, now))
+        {
+            return st->at;
+        }
+        update_pwm(priv, &st->data, ktime_to_ns(st->at));
+        priv->sched_tail++;
+    }
+    return 0;
+}
+
+static enum hrtimer_restart apply_timer_fn(struct hrtimer* timer)
+{
+    struct ethpwm_data* priv = container_of(timer, struct ethpwm_data, apply_timer);
+    enum hrtimer_restart ret = HRTIMER_NORESTART;
+    unsigned long flags;
+    ktime_t next;
+
+    spin_lock_irqsave(&priv->sched_lock, flags);
+    next = apply_scheduled(priv, ktime_get());
+    if(next)
+    {
+        hrtimer_set_expires(timer, next);
+        ret = HRTIMER_RESTART;
+    }
+    spin_unlock_irqrestore(&priv->sched_lock, flags);
+    return ret;
+}
+
+/* Queues channel state to be applied at time at */
+static void rcv_channel_at(struct ethpwm_data* priv, const struct channel_data* chd, ktime_t at)
+{
+    struct sched_state* st;
+    unsigned long flags;
+    ktime_t now = ktime_get();
+
+    priv->records++;
+    if(!ktime_after(at, now))
+    {
+        priv->late++;
+    }
+    spin_lock_irqsave(&priv->sched_lock, flags);
+    if(priv->sched_head - priv->sched_tail >= SCHED_QUEUE_SIZE)
+    {
+        /* queue is full, apply the oldest update now */
+        st = &priv->sched[priv->sched_tail & (SCHED_QUEUE_SIZE - 1)];
+        st->at = now;
+        apply_scheduled(priv, now);
+    }
+    st = &priv->sched[priv->sched_head & (SCHED_QUEUE_SIZE - 1)];
+    st->at = at;
+    st->data = *chd;
+    priv->sched_head++;
+    if(priv->sched_head - priv->sched_tail == 1)
+    {
+        /* otherwise the timer is already armed for an older update */
+        hrtimer_start(&priv->apply_timer, at, HRTIMER_MODE_ABS);
+    }
+    spin_unlock_irqrestore(&priv->sched_lock, flags);
+}
+
+/* Returns output state and flags of the current stream sample */
+static uint8_t stream_state(struct ethpwm_data* priv, struct pwm_state* state)
+{
+    unsigned long flags;
+    uint32_t duty, freq;
+    uint8_t enable, out_flags;
+
+    spin_lock_irqsave(&priv->stream_lock, flags);
+    duty = priv->stream_duty;
+    freq = priv->stream_freq;
+    enable = priv->stream_enable;
+    out_flags = priv->stream_flags;
+    spin_unlock_irqrestore(&priv->stream_lock, flags);
+
+    spin_lock_irqsave(&priv->apply_lock, flags);
+    *state = priv->state;
+    spin_unlock_irqrestore(&priv->apply_lock, flags);
+    if(freq)
+    {
+        state->period = div_u64((uint64_t) NSEC_PER_SEC << ETHPWM_FREQ_SHIFT, freq);
+        state->duty_cycle = mul_u64_u32_shr(state->period, duty, 31);
+        state->enabled = enable;
+    } else
+    {
+        state->enabled = 0;
+    }
+    return out_flags;
+}
+
+/* Applies the current stream sample to hardware PWM */
+static void stream_work_fn(struct work_struct *work)
+{
+    struct ethpwm_data* priv = container_of(work, struct ethpwm_data, stream_work);
+    struct pwm_state state;
+    uint8_t out_flags = stream_state(priv, &state);
+
+    apply_state(priv, &state, out_flags);
+}
+
+static enum hrtimer_restart stream_timer_fn(struct hrtimer* timer)
+{
+    struct ethpwm_data* priv = container_of(timer, struct ethpwm_data, stream_timer);
+    struct pwm_state state;
+    unsigned long flags;
+    unsigned int level;
+    uint32_t period;
+    uint8_t out_flags;
+
+    spin_lock_irqsave(&priv->stream_lock, flags);
+    if(priv->stream_tail == priv->stream_head)
+    {
+        /* host stopped streaming or samples are late, wait for prefill again */
+        priv->underrun++;
+        priv->stream_playing = 0;
+        spin_unlock_irqrestore(&priv->stream_lock, flags);
+        return HRTIMER_NORESTART;
+    }
+    priv->stream_duty = priv->stream_fifo[priv->stream_tail & (STREAM_FIFO_SIZE - 1)];
+    priv->stream_tail++;
+    /* follow clock drift between host and device by buffer level */
+    level = priv->stream_head - priv->stream_tail;
+    period = priv->sample_period;
+    if(level > (STREAM_PREFILL + 1) * priv->stream_block)
+    {
+        period -= period >> 8;
+    } else if(level < priv->stream_block)
+    {
+        period += period >> 8;
+    }
+    spin_unlock_irqrestore(&priv->stream_lock, flags);
+
+    if(priv->type == CHANNEL_PWM)
+    {
+        /* pwm_apply_state() may sleep. A sample still waiting for stream_work is replaced */
+        if(!queue_work(priv->wq, &priv->stream_work))
+        {
+            priv->skipped++;
+        }
+    } else
+    {
+        /* GPIO channels don't sleep, the sample is applied on time */
+        out_flags = stream_state(priv, &state);
+        apply_state(priv, &state, out_flags);
+    }
+    hrtimer_forward_now(timer, ns_to_ktime(period));
+    return HRTIMER_RESTART;
+}
+
+/* Buffers block of samples, starts playback when enough samples are buffered */
+static void rcv_stream(struct ethpwm_data* priv, const pwm_stream_t* blk)
+{
+    const __be32* duty = (const __be32*) (blk + 1);
+    unsigned long flags;
+    int i;
+
+    priv->records++;
+    spin_lock_irqsave(&priv->stream_lock, flags);
+    priv->stream_enable = blk->enable;
+    priv->stream_flags = blk->flags;
+    priv->stream_freq = ntohl(blk->freq);
+    priv->sample_period = max_t(uint32_t, ntohl(blk->sample_period), STREAM_MIN_PERIOD);
+    priv->stream_block = blk->samples;
+    for(i = 0; i < blk->samples; i++)
+    {
+        if(priv->stream_head - priv->stream_tail >= STREAM_FIFO_SIZE)
+        {
+            priv->overrun += blk->samples - i;
+            break;
+        }
+        priv->stream_fifo[priv->stream_head & (STREAM_FIFO_SIZE - 1)] =
+                min_t(uint32_t, ntohl(duty[i]), ETHPWM_DUTY_ONE);
+        priv->stream_head++;
+    }
+    if(!priv->stream_playing && priv->stream_block &&
+       priv->stream_head - priv->stream_tail >= STREAM_PREFILL * priv->stream_block)
+    {
+        priv->stream_playing = 1;
+        hrtimer_start(&priv->stream_timer, ns_to_ktime(0), HRTIMER_MODE_REL);
+    }
+    spin_unlock_irqrestore(&priv->stream_lock, flags);
+}
+
+/* Send reply of the given type with seq of the received frame back to the frame source */
+static void send_reply(struct sk_buff* rx_skb, const pwm_frame_hdr_t* rx_hdr, uint8_t type,
+                       uint8_t count, const void* payload, unsigned int len)
+{
+    struct net_device* dev = rx_skb->dev;
+    pwm_frame_hdr_t* hdr;
+    struct sk_buff* skb = alloc_skb(LL_RESERVED_SPACE(dev) + VLAN_HLEN + sizeof(pwm_frame_hdr_t) + len, GFP_ATOMIC);
+    if(!skb)
+    {
+        return;
+    }
+    skb->dev = dev;
+    skb->pkt_type = PACKET_OUTGOING;
+    skb->priority = tx_priority;
+    skb_reserve(skb, LL_RESERVED_SPACE(dev) + VLAN_HLEN);
+    skb_reset_network_header(skb);
+    if(vlan >= 0)
+    {
+        __vlan_hwaccel_put_tag(skb, htons(ETH_P_8021Q), ethpwm_vlan_tci(vlan, pcp));
+    }
+
+    hdr = (pwm_frame_hdr_t*) skb_put(skb, sizeof(pwm_frame_hdr_t));
+    hdr->seq     = rx_hdr->seq;
+    hdr->marker  = ETHPWM_EXT_MARKER;
+    hdr->version = rx_hdr->version;
+    hdr->type    = type;
+    hdr->count   = count;
+    if(len)
+    {
+        memcpy(skb_put(skb, len), payload, len);
+    }
+
+    if(dev_hard_header(skb, dev, ETHPWM_ETHERTYPE, eth_hdr(rx_skb)->h_source, dev->dev_addr, dev->addr_len) >= 0)
+    {
+        dev_queue_xmit(skb);
+    } else
+    {
+        kfree_skb(skb);
+    }
+}
+
+/* Send ack with seq of the applied frame back to the frame source */
+static void send_ack(struct sk_buff* rx_skb, const pwm_frame_hdr_t* rx_hdr)
+{
+    send_reply(rx_skb, rx_hdr, ETHPWM_FRAME_ACK, 0, NULL, 0);
+}
+
+/* Answer clock sync request with own receive and transmit time.
+   Statistics are summed over all channels, jitter is of the worst channel */
+static int rcv_sync(struct sk_buff *skb, ktime_t rx_time)
+{
+    const pwm_frame_hdr_t* hdr;
+    const struct ethpwm_data* priv;
+    pwm_sync_t sync;
+    int32_t jitter_last = 0;
+    uint32_t jitter_max = 0, late = 0, underrun = 0, overrun = 0;
+    int i;
+
+    for(i = 0; i < ETHPWM_EXT_MARKER; i++)
+    {
+        priv = rcu_dereference(channel_map[i]);
+        if(!priv)
+        {
+            continue;
+        }
+        if(abs(priv->jitter_last) >= abs(jitter_last))
+        {
+            jitter_last = priv->jitter_last;
+        }
+        jitter_max = max(jitter_max, priv->jitter_max);
+        late += priv->late;
+        underrun += priv->underrun;
+        overrun += priv->overrun + priv->skipped;
+    }
+
+    if(!pskb_may_pull(skb, sizeof(pwm_frame_hdr_t) + sizeof(pwm_sync_t)))
+    {
+        return -1;
+    }
+    hdr = (const pwm_frame_hdr_t*) skb_network_header(skb);
+    memcpy(&sync, hdr + 1, sizeof(pwm_sync_t));
+    sync.t2          = cpu_to_be64(ktime_to_ns(rx_time));
+    sync.jitter_last = htonl((uint32_t) jitter_last);
+    sync.jitter_max  = htonl(jitter_max);
+    sync.late        = htonl(late);
+    sync.stream_underrun = htonl(underrun);
+    sync.stream_overrun  = htonl(overrun);
+    sync.t3          = cpu_to_be64(ktime_get_ns());
+    send_reply(skb, hdr, ETHPWM_FRAME_SYNC, 0, &sync, sizeof(pwm_sync_t));
+    return 0;
+}
+
+/* Returns direction of the next step, 0 - no step is needed. Called under sg->lock */
+static int step_direction(const struct ethpwm_stepgen* sg)
+{
+    int64_t left;
+
+    if(!sg->enable)
+    {
+        return 0;
+    }
+    if(sg->mode == ETHPWM_STEP_VELOCITY)
+    {
+        return sg->vel_dir;
+    }
+    /* position mode stops at the step nearest to the target */
+    left = sg->target - sg->position * (1 << ETHPWM_STEP_SHIFT);
+    if(left > (1 << (ETHPWM_STEP_SHIFT - 1)))
+    {
+        return 1;
+    }
+    if(left < -(1 << (ETHPWM_STEP_SHIFT - 1)))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/* Generates step and dir of a step generator, runs while steps are needed */
+static enum hrtimer_restart step_timer_fn(struct hrtimer* timer)
+{
+    struct ethpwm_stepgen* sg = container_of(timer, struct ethpwm_stepgen, timer);
+    unsigned long flags;
+    s64 now = ktime_get_ns();
+    s64 at;
+    int dir;
+
+    spin_lock_irqsave(&sg->lock, flags);
+    if(sg->step_level && now < sg->pulse_end)
+    {
+        /* woken up early, keep the pulse for the full step_len */
+        at = sg->pulse_end;
+        goto restart;
+    }
+    if(sg->step_level)
+    {
+        /* end of the step pulse, the space is at least as long as the pulse */
+        gpiod_set_value(sg->step_gpio, 0);
+        sg->step_level = 0;
+        sg->position += sg->dir;
+        sg->last = now;
+        sg->ready = now + sg->step_len;
+    }
+    if(sg->mode == ETHPWM_STEP_VELOCITY && sg->vel_dir && now >= sg->deadline)
+    {
+        /* the host stopped renewing the velocity, don't let the axis run away */
+        sg->vel_dir = 0;
+        printk_ratelimited(KERN_WARNING LOG_PREFIX "step frame timeout, velocity mode is stopped\n");
+    }
+    dir = step_direction(sg);
+    if(!dir)
+    {
+        sg->running = 0;
+        spin_unlock_irqrestore(&sg->lock, flags);
+        return HRTIMER_NORESTART;
+    }
+    if(dir != sg->dir && now >= sg->last + sg->dir_hold)
+    {
+        /* dir changes dir_hold after the last step and dir_setup before the next one */
+        gpiod_set_value(sg->dir_gpio, dir < 0);
+        sg->dir = dir;
+        sg->ready = max_t(s64, sg->ready, now + sg->dir_setup);
+    }
+    if(dir != sg->dir)
+    {
+        at = sg->last + sg->dir_hold;
+    } else
+    {
+        at = max_t(s64, sg->ready, sg->last_rise + (s64) sg->interval);
+        if(now >= at)
+        {
+            gpiod_set_value(sg->step_gpio, 1);
+            sg->step_level = 1;
+            /* the next step counts from the planned edge, so wake-up latency doesn't lower
+               the rate, unless the step is late by a whole interval */
+            sg->last_rise = now - at < (s64) sg->interval ? at : now;
+            sg->pulse_end = now + sg->step_len;
+            at = sg->pulse_end;
+        }
+    }
+restart:
+    spin_unlock_irqrestore(&sg->lock, flags);
+
+    /* absolute expiry, so wake-up latency doesn't shorten the pulse. Wake up at least
+       every STEP_POLL_PERIOD to pick up a faster rate */
+    hrtimer_set_expires(timer, ns_to_ktime(min_t(s64, at, now + STEP_POLL_PERIOD)));
+    return HRTIMER_RESTART;
+}
+
+/* Sets new target of the step generator, returns the generated position */
+static int32_t rcv_step(struct ethpwm_stepgen* sg, const pwm_step_t* rec)
+{
+    int64_t target = (int64_t) be64_to_cpu(rec->target);
+    uint32_t period = ntohl(rec->period);
+    uint64_t dist, limit, interval;
+    unsigned long flags;
+    int32_t position;
+    s64 now = ktime_get_ns();
+
+    spin_lock_irqsave(&sg->lock, flags);
+    /* rate of the previous target, if it was followed until now */
+    limit = sg->enable && sg->mode == ETHPWM_STEP_POSITION && now < sg->deadline ? sg->rate : 0;
+    sg->enable = rec->enable;
+    sg->mode = rec->mode;
+    sg->step_len = max_t(uint32_t, ntohl(rec->step_len), STEP_MIN_LEN);
+    sg->dir_hold = ntohl(rec->dir_hold);
+    sg->dir_setup = ntohl(rec->dir_setup);
+    if(rec->mode == ETHPWM_STEP_VELOCITY)
+    {
+        /* interval is 1 s / velocity */
+        dist = target < 0 ? -target : target;
+        interval = dist ? div64_u64((uint64_t) NSEC_PER_SEC << ETHPWM_STEP_SHIFT, dist) : 0;
+        sg->vel_dir = target > 0 ? 1 : (target < 0 ? -1 : 0);
+    } else
+    {
+        /* target is reached at the end of period, interval is period / distance. The rate
+           ramps up from the previous one and from zero after a gap in step frames, so
+           a jump of the target is not made at once. The rest of the distance is left
+           as following error in the position feedback */
+        sg->target = target;
+        target -= sg->position * (1 << ETHPWM_STEP_SHIFT);
+        dist = target < 0 ? -target : target;
+        dist = min_t(uint64_t, dist, limit + (limit >> STEP_RAMP_SHIFT) + (1 << ETHPWM_STEP_SHIFT));
+        sg->rate = dist;
+        interval = dist ? div64_u64((uint64_t) period << ETHPWM_STEP_SHIFT, dist) : 0;
+    }
+    sg->deadline = now + STEP_TIMEOUT_PERIODS * (s64) max_t(uint32_t, period, STEP_POLL_PERIOD);
+    sg->interval = max_t(uint64_t, interval, STEP_MIN_PERIOD);
+    if(step_direction(sg) && !sg->running)
+    {
+        sg->running = 1;
+        hrtimer_start(&sg->timer, 0, HRTIMER_MODE_REL);
+    }
+    position = (int32_t) sg->position;
+    spin_unlock_irqrestore(&sg->lock, flags);
+    return position;
+}
+
+/* Sets step generator targets and answers with the generated positions */
+static int rcv_step_frame(struct ethpwm_device* edev, struct sk_buff *skb)
+{
+    const pwm_frame_hdr_t* hdr;
+    const pwm_step_t* rec;
+    pwm_step_fb_t fb[ETHPWM_MAX_STEP];
+    unsigned int count = 0;
+    int len, i;
+
+    if(!pskb_may_pull(skb, sizeof(pwm_frame_hdr_t)))
+    {
+        return -1;
+    }
+    hdr = (const pwm_frame_hdr_t*) skb_network_header(skb);
+    len = ethpwm_frame_len(hdr, sizeof(pwm_frame_hdr_t));
+    if(len < 0 || !pskb_may_pull(skb, len))
+    {
+        return -1;
+    }
+    hdr = (const pwm_frame_hdr_t*) skb_network_header(skb);
+    rec = (const pwm_step_t*) (hdr + 1);
+    for(i = 0; i < hdr->count; i++, rec++)
+    {
+        if(rec->joint >= edev->num_stepgens)
+        {
+            continue;
+        }
+        memset(&fb[count], 0, sizeof(pwm_step_fb_t));
+        fb[count].joint = rec->joint;
+        fb[count].position = htonl((uint32_t) rcv_step(&edev->stepgens[rec->joint], rec));
+        count++;
+    }
+    send_reply(skb, hdr, ETHPWM_FRAME_STEP_FB, count, fb, count * sizeof(pwm_step_fb_t));
+    return 0;
+}
+
+/* Stops step generation, the current step pulse is completed */
+static void safe_stepgen(struct ethpwm_stepgen* sg)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&sg->lock, flags);
+    sg->enable = 0;
+    spin_unlock_irqrestore(&sg->lock, flags);
+}
+
+/* Drops scheduled and streamed states and switches the channel off through apply_work */
+static void safe_channel(struct ethpwm_data* priv)
+{
+    struct channel_data chd;
+    unsigned long flags;
+
+    spin_lock_irqsave(&priv->sched_lock, flags);
+    priv->sched_tail = priv->sched_head;
+    spin_unlock_irqrestore(&priv->sched_lock, flags);
+
+    spin_lock_irqsave(&priv->stream_lock, flags);
+    priv->stream_tail = priv->stream_head;
+    priv->stream_enable = 0;
+    spin_unlock_irqrestore(&priv->stream_lock, flags);
+
+    /* applied even if the data is already off, streaming bypasses it */
+    spin_lock_irqsave(&priv->apply_lock, flags);
+    chd = priv->data;
+    priv->init = 0;
+    spin_unlock_irqrestore(&priv->apply_lock, flags);
+    chd.enable = 0;
+    chd.rx_time = ktime_get();
+    update_pwm(priv, &chd, 0);
+}
+
+/* No frames from the host within the timeout, switch all outputs off */
+static enum hrtimer_restart watchdog_timer_fn(struct hrtimer* timer)
+{
+    struct ethpwm_data* priv;
+    struct ethpwm_device* edev;
+    unsigned int i;
+
+    watchdog_timeouts++;
+    printk_ratelimited(KERN_WARNING LOG_PREFIX "host timeout, outputs are switched off\n");
+    rcu_read_lock();
+    for(i = 0; i < ETHPWM_EXT_MARKER; i++)
+    {
+        priv = rcu_dereference(channel_map[i]);
+        if(priv)
+        {
+            safe_channel(priv);
+        }
+    }
+    /* I/O GPIOs do not sleep, see get_io_gpios() */
+    edev = rcu_dereference(io_device);
+    for(i = 0; edev && edev->out_gpios && i < edev->out_gpios->ndescs; i++)
+    {
+        gpiod_set_value(edev->out_gpios->desc[i], 0);
+    }
+    edev = rcu_dereference(step_device);
+    for(i = 0; edev && i < edev->num_stepgens; i++)
+    {
+        safe_stepgen(&edev->stepgens[i]);
+    }
+    rcu_read_unlock();
+    return HRTIMER_NORESTART;
+}
+
+static void feed_watchdog(void)
+{
+    ktime_t timeout = READ_ONCE(watchdog_timeout);
+
+    if(timeout)
+    {
+        hrtimer_start(&watchdog_timer, timeout, HRTIMER_MODE_REL);
+    }
+}
+
+/* Set watchdog timeout and answer with the number of timeouts */
+static int rcv_heartbeat(struct sk_buff *skb)
 {
-    struct pwm_work* data = (struct pwm_work*) work;
-
-    pwm_apply_state(data->pwm, &data->state);
+    const pwm_frame_hdr_t* hdr;
+    pwm_heartbeat_t hb;
 
-    kfree(work);
+    if(!pskb_may_pull(skb, sizeof(pwm_frame_hdr_t) + sizeof(pwm_heartbeat_t)))
+    {
+        return -1;
+    }
+    hdr = (const pwm_frame_hdr_t*) skb_network_header(skb);
+    memcpy(&hb, hdr + 1, sizeof(pwm_heartbeat_t));
+    WRITE_ONCE(watchdog_timeout, ns_to_ktime(ntohl(hb.timeout)));
+    if(hb.timeout)
+    {
+        feed_watchdog();
+    } else
+    {
+        hrtimer_try_to_cancel(&watchdog_timer);
+    }
+    hb.timeouts = htonl(watchdog_timeouts);
+    send_reply(skb, hdr, ETHPWM_FRAME_HEARTBEAT, 0, &hb, sizeof(pwm_heartbeat_t));
+    return 0;
 }
 
-static inline pwm_packet_t *ethpwm_hdr(const struct sk_buff *skb)
+/* Set outputs from the frame bitmap and answer with the inputs */
+static int rcv_io(struct ethpwm_device* edev, struct sk_buff *skb)
 {
-	return (pwm_packet_t*) skb_network_header(skb);
+    const pwm_frame_hdr_t* hdr;
+    const __u8* bits;
+    __u8 in[ETHPWM_IO_BYTES(ETHPWM_MAX_IO)] = {0};
+    unsigned int num_in = edev->in_gpios ? edev->in_gpios->ndescs : 0;
+    unsigned int i;
+    int len;
+
+    if(!pskb_may_pull(skb, sizeof(pwm_frame_hdr_t)))
+    {
+        return -1;
+    }
+    hdr = (const pwm_frame_hdr_t*) skb_network_header(skb);
+    len = ethpwm_frame_len(hdr, sizeof(pwm_frame_hdr_t));
+    if(len < 0 || !pskb_may_pull(skb, len))
+    {
+        return -1;
+    }
+    hdr = (const pwm_frame_hdr_t*) skb_network_header(skb);
+    bits = (const __u8*) (hdr + 1);
+    for(i = 0; edev->out_gpios && i < edev->out_gpios->ndescs && i < hdr->count; i++)
+    {
+        gpiod_set_value(edev->out_gpios->desc[i], (bits[i / 8] >> (i % 8)) & 1);
+    }
+    for(i = 0; i < num_in; i++)
+    {
+        if(gpiod_get_value(edev->in_gpios->desc[i]) > 0)
+        {
+            in[i / 8] |= 1 << (i % 8);
+        }
+    }
+    send_reply(skb, hdr, ETHPWM_FRAME_IO, num_in, in, ETHPWM_IO_BYTES(num_in));
+    return 0;
 }
 
-static inline int cmp_channel(const struct channel_data* d1, const struct channel_data* d2)
+/* Request GPIOs of remote digital I/O or GPIO channels, they are accessed from
+   the packet handler and hrtimers and must not sleep */
+static struct gpio_descs* get_io_gpios(struct device* dev, const char* con_id, enum gpiod_flags flags)
 {
-    if(d1->enable != d2->enable ||
-       d1->freq   != d2->freq ||
-       d1->scale  != d2->scale ||
-       d1->offset != d2->offset ||
-       d1->value  != d2->value)
+    struct gpio_descs* gpios = devm_gpiod_get_array_optional(dev, con_id, flags);
+    unsigned int i;
+
+    if(IS_ERR_OR_NULL(gpios))
     {
-        return 1;
+        return gpios;
     }
-    return 0;
+    if(gpios->ndescs > ETHPWM_MAX_IO)
+    {
+        printk(KERN_ERR LOG_PREFIX "too many %s-gpios, max %d\n", con_id, ETHPWM_MAX_IO);
+        return ERR_PTR(-EINVAL);
+    }
+    for(i = 0; i < gpios->ndescs; i++)
+    {
+        if(gpiod_cansleep(gpios->desc[i]))
+        {
+            printk(KERN_ERR LOG_PREFIX "%s-gpios %u can sleep\n", con_id, i);
+            return ERR_PTR(-EINVAL);
+        }
+    }
+    return gpios;
 }
 
-static inline void parse_packet(const pwm_packet_t* pkt, struct channel_data* data)
+static int rcv_stream_frame(struct sk_buff *skb)
 {
-    data->seq    = ntohl(pkt->seq);
-    data->enable = pkt->enable;
-    data->freq   = ntohs(pkt->freq);
-    data->scale  = ntohs(pkt->scale);
-    data->offset = ntohs(pkt->offset);
-    data->value  = ntohs(pkt->value);
+    struct ethpwm_data* priv;
+    const pwm_frame_hdr_t* hdr;
+    const pwm_stream_t* blk;
+    const __u8* p;
+    int len, i;
+
+    if(!pskb_may_pull(skb, skb->len))
+    {
+        return -1;
+    }
+    hdr = (const pwm_frame_hdr_t*) skb_network_header(skb);
+    len = ethpwm_frame_len(hdr, skb->len);
+    if(len < 0 || len > skb->len)
+    {
+        return -1;
+    }
+    p = (const __u8*) (hdr + 1);
+
+    for(i = 0; i < hdr->count; i++)
+    {
+        blk = (const pwm_stream_t*) p;
+        priv = find_channel(blk->channel);
+        if(priv)
+        {
+            rcv_stream(priv, blk);
+        }
+        p += sizeof(pwm_stream_t) + blk->samples * sizeof(__be32);
+    }
+    send_ack(skb, hdr);
+    return 0;
 }
 
-static inline void update_pwm(struct ethpwm_data* priv)
+static int rcv_frame(struct sk_buff *skb)
 {
-    struct pwm_work* work;
-    if(!priv->init)
+    struct ethpwm_data* priv;
+    struct ethpwm_device* edev;
+    const pwm_frame_hdr_t* hdr;
+    const __u8* rec;
+    struct channel_data chd;
+    ethpwm_state_t st;
+    unsigned int rec_size;
+    ktime_t rx_time = ktime_get();
+    ktime_t at = 0;
+    uint32_t seq;
+    int len, i;
+
+    /* frames are short, linear data lets the length of stream frames be checked */
+    if(!pskb_may_pull(skb, skb->len))
+    {
+        return -1;
+    }
+    hdr = (const pwm_frame_hdr_t*) skb_network_header(skb);
+    len = ethpwm_frame_len(hdr, skb->len);
+    if(len < 0 || len > skb->len || !ethpwm_record_size(hdr->version))
+    {
+        return -1;
+    }
+    switch(hdr->type)
+    {
+        case ETHPWM_FRAME_ACK:
+            /* ack from another receiver */
+            return 0;
+        case ETHPWM_FRAME_PWM_AT:
+        case ETHPWM_FRAME_PWM:
+        case ETHPWM_FRAME_STREAM:
+            /* a duplicate or stale frame may be late in the network, it does not prove the host is alive */
+            if(check_seq(ntohl(hdr->seq)))
+            {
+                feed_watchdog();
+            }
+            break;
+        default:
+            /* I/O, step, heartbeat and sync frames have their own seq */
+            feed_watchdog();
+            break;
+    }
+    switch(hdr->type)
     {
-        priv->init = 1;
+        case ETHPWM_FRAME_HEARTBEAT:
+            return rcv_heartbeat(skb);
+        case ETHPWM_FRAME_SYNC:
+            return rcv_sync(skb, rx_time);
+        case ETHPWM_FRAME_STREAM:
+            return rcv_stream_frame(skb);
+        case ETHPWM_FRAME_IO:
+            edev = rcu_dereference(io_device);
+            return edev ? rcv_io(edev, skb) : 0;
+        case ETHPWM_FRAME_STEP:
+            edev = rcu_dereference(step_device);
+            return edev ? rcv_step_frame(edev, skb) : 0;
+        case ETHPWM_FRAME_PWM_AT:
+        case ETHPWM_FRAME_PWM:
+            break;
+        default:
+            return -1;
     }
-    priv->state.period = (unsigned int) div_u64(1000000000L, priv->data.freq);
-    priv->state.duty_cycle = priv->state.period * priv->data.value / priv->data.scale;
-    if(priv->state.duty_cycle > priv->state.period)
+    rec_size = ethpwm_record_size(hdr->version);
+    rec = (const __u8*) hdr + ethpwm_records_offset(hdr);
+    seq = ntohl(hdr->seq);
+    if(hdr->type == ETHPWM_FRAME_PWM_AT)
     {
-        priv->state.duty_cycle = priv->state.period;
+        at = ns_to_ktime(be64_to_cpu(((const pwm_time_t*) (hdr + 1))->time));
     }
-    priv->state.enabled = priv->data.enable;
 
 #ifdef PWM_DEBUG
-    printk(KERN_INFO LOG_PREFIX "PWM period: %u, duty_cycle: %u, polarity: %d\n", priv->state.period, priv->state.duty_cycle, priv->state.polarity);
+    printk(KERN_INFO LOG_PREFIX "seq: %u, version: %hhu, records: %hhu\n", seq, hdr->version, hdr->count);
 #endif
-    
-    work = (struct pwm_work*) kmalloc(sizeof(struct pwm_work), GFP_KERNEL);
-    if(work)
+
+    for(i = 0; i < hdr->count; i++, rec += rec_size)
     {
-        INIT_WORK((struct work_struct*) work, update_pwm_work);
-        work->state = priv->state;
-        work->pwm = priv->pwm;
-        queue_work(priv->wq, (struct work_struct*) work);
+        /* channel is the first byte of any record */
+        priv = find_channel(rec[0]);
+        if(!priv)
+        {
+            continue;
+        }
+        ethpwm_decode_record(rec, hdr->version, &st);
+        set_channel_data(seq, &st, &chd);
+        chd.rx_time = rx_time;
+        if(hdr->type == ETHPWM_FRAME_PWM_AT)
+        {
+            rcv_channel_at(priv, &chd, at);
+        } else
+        {
+            rcv_channel(priv, &chd);
+        }
     }
+    send_ack(skb, hdr);
+    return 0;
+}
+
+/* Destination is this device or broadcast, the default destination of the host */
+static bool is_own_dest(const struct sk_buff* skb, const struct net_device* dev)
+{
+    const u8* dest = eth_hdr(skb)->h_dest;
+
+    return is_multicast_ether_addr(dest) || ether_addr_equal(dest, dev->dev_addr);
 }
 
 static int ethpwm_rcv(struct sk_buff *skb, struct net_device *dev,
@@ -128,17 +1245,30 @@ static int ethpwm_rcv(struct sk_buff *skb, struct net_device *dev,
 {
     pwm_packet_t* pkt;
     struct channel_data chd;
-    struct ethpwm_data* priv = pt->af_packet_priv;
+    ethpwm_state_t st;
+    struct ethpwm_data* priv;
 
-    if(skb->pkt_type == PACKET_OTHERHOST || skb->pkt_type == PACKET_LOOPBACK)
+    /* frames tagged with a VLAN id, which has no VLAN device here, arrive as PACKET_OTHERHOST */
+    if((skb->pkt_type == PACKET_OTHERHOST && (vlan < 0 || !is_own_dest(skb, dev))) ||
+       skb->pkt_type == PACKET_LOOPBACK)
         goto consumeskb;
 
-    pkt = ethpwm_hdr(skb);
-    if(pkt == NULL)
+    rx_stats.frames++;
+    /* the legacy packet is the shortest one */
+    if(!pskb_may_pull(skb, sizeof(pwm_frame_hdr_t)))
     {
-        printk(KERN_ERR LOG_PREFIX "pkt is NULL\n");
         goto freeskb;
     }
+    pkt = ethpwm_hdr(skb);
+
+    if(pkt->channel == ETHPWM_EXT_MARKER)
+    {
+        if(rcv_frame(skb) != 0)
+        {
+            goto freeskb;
+        }
+        goto consumeskb;
+    }
 
 #ifdef PWM_DEBUG    
     printk(KERN_INFO LOG_PREFIX "seq: %u, channel: %hhu, enable: %hhu, freq: %hu, value: %hu, scale: %hu, offset: %hu\n",
@@ -151,30 +1281,34 @@ static int ethpwm_rcv(struct sk_buff *skb, struct net_device *dev,
             ntohs(pkt->offset));
 #endif
 
-    if(pkt->channel != priv->channel)
+    if(!pskb_may_pull(skb, sizeof(pwm_packet_t)))
     {
-        goto consumeskb;
+        goto freeskb;
     }
-
-    parse_packet(pkt, &chd);
-
-    if(priv->init && priv->data.seq + 1 != chd.seq)
+    pkt = ethpwm_hdr(skb);
+    if(check_seq(ntohl(pkt->seq)))
     {
-        printk(KERN_ERR LOG_PREFIX "reorder or lost packet last_seq: %u, seq %u\n", 
-                priv->data.seq, chd.seq);
+        feed_watchdog();
     }
 
-    if(!priv->init || cmp_channel(&chd, &priv->data))
+    priv = find_channel(pkt->channel);
+    if(!priv)
     {
-        priv->data = chd;
-        update_pwm(priv);
+        goto consumeskb;
     }
 
+    ethpwm_decode_packet(pkt, &st);
+    set_channel_data(ntohl(pkt->seq), &st, &chd);
+    chd.rx_time = ktime_get();
+    rcv_channel(priv, &chd);
+
 consumeskb:
     consume_skb(skb);
     return NET_RX_SUCCESS;
 
 freeskb:
+    rx_stats.dropped++;
+    printk_ratelimited(KERN_WARNING LOG_PREFIX "malformed packet dropped\n");
     kfree_skb(skb);
     return NET_RX_DROP;
 }
@@ -182,32 +1316,76 @@ freeskb:
 
 static struct packet_type ethpwm_packet_type __read_mostly = 
 {
-    .type = cpu_to_be16(0xEAEB),
+    .type = cpu_to_be16(ETHPWM_ETHERTYPE),
     .func = ethpwm_rcv,
 };
 
 
-static int ethpwm_probe(struct platform_device *pdev)
+static int apply_stats_show(struct seq_file* m, void* v)
 {
-    struct ethpwm_data* priv = (struct ethpwm_data*) devm_kzalloc(&pdev->dev, sizeof(struct ethpwm_data), GFP_KERNEL);
-    
-    printk(KERN_INFO LOG_PREFIX "device is probed\n");
-    
-    if(!priv)
+    const struct ethpwm_data* priv = m->private;
+    int i;
+
+    seq_printf(m, "applied: %u\n", priv->applied);
+    seq_printf(m, "coalesced: %u\n", priv->coalesced);
+    seq_puts(m, "latency_us count\n");
+    for(i = 0; i < LATENCY_HIST_SIZE - 1; i++)
     {
-        printk(KERN_ERR LOG_PREFIX  "out off memory\n");
-        return -ENOMEM;
+        seq_printf(m, "<%u %u\n", 1u << i, priv->latency_hist[i]);
     }
+    seq_printf(m, ">=%u %u\n", 1u << (LATENCY_HIST_SIZE - 2), priv->latency_hist[LATENCY_HIST_SIZE - 1]);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(apply_stats);
+
+/* Current state of the channel */
+static int state_show(struct seq_file* m, void* v)
+{
+    const struct ethpwm_data* priv = m->private;
 
-    priv->channel = 0;
+    seq_printf(m, "seq: %u\n", priv->data.seq);
+    seq_printf(m, "enable: %hhu\n", priv->data.enable);
+    seq_printf(m, "freq: %u.%02u\n", priv->data.freq >> ETHPWM_FREQ_SHIFT,
+               ((priv->data.freq & ((1u << ETHPWM_FREQ_SHIFT) - 1)) * 100) >> ETHPWM_FREQ_SHIFT);
+    seq_printf(m, "duty: %u\n", priv->data.duty);
+    seq_printf(m, "flags: 0x%02hhx\n", priv->out_flags);
+    seq_printf(m, "period_ns: %llu\n", (unsigned long long) priv->state.period);
+    seq_printf(m, "duty_cycle_ns: %llu\n", (unsigned long long) priv->state.duty_cycle);
+    seq_printf(m, "enabled: %d\n", priv->state.enabled);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(state);
 
-    priv->pwm = pwm_get(&pdev->dev, NULL);
+/* Gets hardware PWM of the channel */
+static int init_pwm_output(struct device* dev, struct ethpwm_data* priv, const char* name)
+{
+    priv->type = CHANNEL_PWM;
+    priv->pwm = pwm_get(dev, name);
     if(IS_ERR(priv->pwm))
     {
-        printk(KERN_ERR LOG_PREFIX  "PWM device is not found\n");
+        printk(KERN_ERR LOG_PREFIX  "PWM device of channel #%hhu is not found\n", priv->channel);
+        priv->pwm = NULL;
         return -ENODEV;
     }
-    printk(KERN_INFO LOG_PREFIX "PWM device is found\n");
+    pwm_init_state(priv->pwm, &priv->state);
+    return 0;
+}
+
+/* Sets up PWM or PDM generator on the GPIO */
+static void init_soft_output(struct ethpwm_data* priv, struct gpio_desc* gpio, const char* mode)
+{
+    priv->type = mode && !strcmp(mode, "pdm") ? CHANNEL_SOFT_PDM : CHANNEL_SOFT_PWM;
+    priv->gpio = gpio;
+    spin_lock_init(&priv->soft_lock);
+    hrtimer_init(&priv->soft_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    priv->soft_timer.function = soft_timer_fn;
+    memset(&priv->state, 0, sizeof(priv->state));
+}
+
+/* Initializes apply path of the channel, its output is set up by init_pwm_output() or init_soft_output() */
+static int init_channel(struct ethpwm_data* priv)
+{
+    char name_buf[8];
 
     /* Initialize workqueue */
     priv->wq = alloc_ordered_workqueue("ethpwm%hhu", WQ_HIGHPRI, priv->channel);
@@ -217,40 +1395,342 @@ static int ethpwm_probe(struct platform_device *pdev)
         return -ENODEV;
     }
 
-    /* Initialize PWM */
-    pwm_init_state(priv->pwm, &priv->state);
-    priv->state.polarity = PWM_POLARITY_NORMAL;
-    priv->state.enabled = 0;
-    pwm_apply_state(priv->pwm, &priv->state);
+    /* Initialize apply path */
+    spin_lock_init(&priv->apply_lock);
+    INIT_WORK(&priv->apply_work, apply_work_fn);
 
-    /* install protocol handler */
-    ethpwm_packet_type.af_packet_priv = priv;
-    dev_add_pack(&ethpwm_packet_type);
+    /* Initialize scheduled apply */
+    spin_lock_init(&priv->sched_lock);
+    hrtimer_init(&priv->apply_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    priv->apply_timer.function = apply_timer_fn;
 
-    printk(KERN_INFO LOG_PREFIX "Protocol handler is installed\n");
+    /* Initialize streaming mode */
+    spin_lock_init(&priv->stream_lock);
+    hrtimer_init(&priv->stream_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    priv->stream_timer.function = stream_timer_fn;
+    INIT_WORK(&priv->stream_work, stream_work_fn);
 
-    /* save driver data */
-    platform_set_drvdata(pdev, priv);
+    /* Initialize output */
+    priv->state.polarity = PWM_POLARITY_NORMAL;
+    priv->state.enabled = 0;
+    apply_state(priv, &priv->state, 0);
 
-    printk(KERN_INFO LOG_PREFIX "device is loaded at channel #%hhu\n", priv->channel);
-    
-    return 0;   //return 0 for success
+    /* statistics in /sys/kernel/debug/ethpwm/chN */
+    snprintf(name_buf, sizeof(name_buf), "ch%hhu", priv->channel);
+    priv->debugfs = debugfs_create_dir(name_buf, debugfs_root);
+    debugfs_create_file("apply", 0444, priv->debugfs, priv, &apply_stats_fops);
+    debugfs_create_file("state", 0444, priv->debugfs, priv, &state_fops);
+    debugfs_create_u32("records", 0444, priv->debugfs, &priv->records);
+    debugfs_create_u32("unchanged", 0444, priv->debugfs, &priv->unchanged);
+    debugfs_create_u32("stream_skipped", 0444, priv->debugfs, &priv->skipped);
+
+    printk(KERN_INFO LOG_PREFIX "%s is loaded at channel #%hhu\n",
+           priv->type == CHANNEL_PWM ? "PWM device" : priv->type == CHANNEL_SOFT_PWM ? "GPIO PWM" : "GPIO PDM",
+           priv->channel);
+    return 0;
 }
 
-static int ethpwm_remove(struct platform_device *pdev)
+/* Releases output of the channel */
+static void free_output(struct ethpwm_data* priv)
 {
-    struct ethpwm_data *priv = platform_get_drvdata(pdev);
-    if(priv)
+    if(priv->type == CHANNEL_PWM)
     {
-        flush_workqueue(priv->wq);
-        destroy_workqueue(priv->wq);
-        dev_remove_pack(&ethpwm_packet_type);
         if(priv->pwm)
         {
             priv->state.enabled = 0;
             pwm_apply_state(priv->pwm, &priv->state);
             pwm_put(priv->pwm);
         }
+    } else
+    {
+        hrtimer_cancel(&priv->soft_timer);
+        gpiod_set_value(priv->gpio, 0);
+    }
+    if(priv->dir_gpio)
+    {
+        gpiod_set_value(priv->dir_gpio, 0);
+    }
+}
+
+/* Stops the channel, it must not be reachable from the packet handler */
+static void free_channel(struct ethpwm_data* priv)
+{
+    debugfs_remove_recursive(priv->debugfs);
+    hrtimer_cancel(&priv->apply_timer);
+    hrtimer_cancel(&priv->stream_timer);
+    flush_workqueue(priv->wq);
+    destroy_workqueue(priv->wq);
+    free_output(priv);
+}
+
+/* Adds channels and I/O of the device to the protocol handler */
+static int publish_device(struct ethpwm_device* edev)
+{
+    struct ethpwm_data* priv;
+    unsigned int i;
+
+    for(i = 0; i < edev->num_channels; i++)
+    {
+        priv = &edev->channels[i];
+        if(rcu_access_pointer(channel_map[priv->channel]))
+        {
+            printk(KERN_ERR LOG_PREFIX "channel #%hhu is already used\n", priv->channel);
+            return -EBUSY;
+        }
+        rcu_assign_pointer(channel_map[priv->channel], priv);
+    }
+    if(edev->in_gpios || edev->out_gpios)
+    {
+        if(rcu_access_pointer(io_device))
+        {
+            printk(KERN_ERR LOG_PREFIX "I/O GPIOs are already used by another device\n");
+            return -EBUSY;
+        }
+        rcu_assign_pointer(io_device, edev);
+    }
+    if(edev->num_stepgens)
+    {
+        if(rcu_access_pointer(step_device))
+        {
+            printk(KERN_ERR LOG_PREFIX "step generators are already used by another device\n");
+            return -EBUSY;
+        }
+        rcu_assign_pointer(step_device, edev);
+    }
+    return 0;
+}
+
+/* Removes channels and I/O of the device from the protocol handler */
+static void unpublish_device(struct ethpwm_device* edev)
+{
+    unsigned int i;
+
+    for(i = 0; i < edev->num_channels; i++)
+    {
+        if(rcu_access_pointer(channel_map[edev->channels[i].channel]) == &edev->channels[i])
+        {
+            RCU_INIT_POINTER(channel_map[edev->channels[i].channel], NULL);
+        }
+    }
+    if(rcu_access_pointer(io_device) == edev)
+    {
+        RCU_INIT_POINTER(io_device, NULL);
+    }
+    if(rcu_access_pointer(step_device) == edev)
+    {
+        RCU_INIT_POINTER(step_device, NULL);
+    }
+}
+
+static void free_device(struct ethpwm_device* edev)
+{
+    unsigned int i;
+
+    mutex_lock(&channel_map_lock);
+    unpublish_device(edev);
+    mutex_unlock(&channel_map_lock);
+    /* wait for packet handlers which may still use the channels */
+    synchronize_net();
+    for(i = 0; i < edev->num_channels; i++)
+    {
+        free_channel(&edev->channels[i]);
+    }
+    for(i = 0; edev->out_gpios && i < edev->out_gpios->ndescs; i++)
+    {
+        gpiod_set_value(edev->out_gpios->desc[i], 0);
+    }
+    for(i = 0; i < edev->num_stepgens; i++)
+    {
+        hrtimer_cancel(&edev->stepgens[i].timer);
+        gpiod_set_value(edev->stepgens[i].step_gpio, 0);
+    }
+}
+
+/* Requests step-gpios and dir-gpios, one step generator per pair */
+static int init_stepgens(struct device* dev, struct ethpwm_device* edev)
+{
+    struct gpio_descs* step_gpios = get_io_gpios(dev, "step", GPIOD_OUT_LOW);
+    struct gpio_descs* dir_gpios = get_io_gpios(dev, "dir", GPIOD_OUT_LOW);
+    struct ethpwm_stepgen* sg;
+    unsigned int count, i;
+
+    if(IS_ERR(step_gpios) || IS_ERR(dir_gpios))
+    {
+        printk(KERN_ERR LOG_PREFIX  "step GPIOs are not available\n");
+        return -ENODEV;
+    }
+    count = step_gpios ? step_gpios->ndescs : 0;
+    if(count != (dir_gpios ? dir_gpios->ndescs : 0) || count > ETHPWM_MAX_STEP)
+    {
+        printk(KERN_ERR LOG_PREFIX  "step-gpios and dir-gpios must be pairs, max %d\n", ETHPWM_MAX_STEP);
+        return -EINVAL;
+    }
+    if(!count)
+    {
+        return 0;
+    }
+    edev->stepgens = devm_kcalloc(dev, count, sizeof(struct ethpwm_stepgen), GFP_KERNEL);
+    if(!edev->stepgens)
+    {
+        printk(KERN_ERR LOG_PREFIX  "out off memory\n");
+        return -ENOMEM;
+    }
+    for(i = 0; i < count; i++)
+    {
+        sg = &edev->stepgens[i];
+        sg->step_gpio = step_gpios->desc[i];
+        sg->dir_gpio = dir_gpios->desc[i];
+        sg->dir = 1;
+        spin_lock_init(&sg->lock);
+        hrtimer_init(&sg->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        sg->timer.function = step_timer_fn;
+    }
+    edev->num_stepgens = count;
+    printk(KERN_INFO LOG_PREFIX "%u step generators\n", count);
+    return 0;
+}
+
+static int ethpwm_probe(struct platform_device *pdev)
+{
+    struct device_node* np = pdev->dev.of_node;
+    struct ethpwm_device* edev;
+    struct ethpwm_data* priv;
+    const char* name;
+    uint32_t channel;
+    int count, num_pwm, num_gpio, i, ret;
+
+    printk(KERN_INFO LOG_PREFIX "device is probed\n");
+
+    edev = (struct ethpwm_device*) devm_kzalloc(&pdev->dev, sizeof(struct ethpwm_device), GFP_KERNEL);
+    if(!edev)
+    {
+        printk(KERN_ERR LOG_PREFIX  "out off memory\n");
+        return -ENOMEM;
+    }
+
+    /* one channel per pwms entry, several entries are requested by pwm-names.
+       GPIO channels from pwm-gpios follow them */
+    num_pwm = of_property_count_strings(np, "pwm-names");
+    if(num_pwm <= 0)
+    {
+        num_pwm = of_count_phandle_with_args(np, "pwms", "#pwm-cells") > 0 ? 1 : 0;
+    }
+    edev->pwm_gpios = get_io_gpios(&pdev->dev, "pwm", GPIOD_OUT_LOW);
+    if(IS_ERR(edev->pwm_gpios))
+    {
+        printk(KERN_ERR LOG_PREFIX  "PWM GPIOs are not available\n");
+        return -ENODEV;
+    }
+    num_gpio = edev->pwm_gpios ? edev->pwm_gpios->ndescs : 0;
+    count = num_pwm + num_gpio;
+    ret = init_stepgens(&pdev->dev, edev);
+    if(ret)
+    {
+        return ret;
+    }
+    if(!count && !edev->num_stepgens)
+    {
+        printk(KERN_ERR LOG_PREFIX  "no pwms, pwm-gpios or step-gpios\n");
+        return -ENODEV;
+    }
+    edev->channels = devm_kcalloc(&pdev->dev, count, sizeof(struct ethpwm_data), GFP_KERNEL);
+    if(!edev->channels)
+    {
+        printk(KERN_ERR LOG_PREFIX  "out off memory\n");
+        return -ENOMEM;
+    }
+
+    /* Remote digital I/O is optional */
+    edev->in_gpios = get_io_gpios(&pdev->dev, "in", GPIOD_IN);
+    edev->out_gpios = get_io_gpios(&pdev->dev, "out", GPIOD_OUT_LOW);
+    if(IS_ERR(edev->in_gpios) || IS_ERR(edev->out_gpios))
+    {
+        printk(KERN_ERR LOG_PREFIX  "I/O GPIOs are not available\n");
+        return -ENODEV;
+    }
+    printk(KERN_INFO LOG_PREFIX "%u inputs, %u outputs\n",
+           edev->in_gpios ? edev->in_gpios->ndescs : 0, edev->out_gpios ? edev->out_gpios->ndescs : 0);
+
+    for(i = 0; i < count; i++)
+    {
+        priv = &edev->channels[i];
+        /* protocol channel numbers, consecutive from 0 by default */
+        if(of_property_read_u32_index(np, "channels", i, &channel))
+        {
+            channel = i;
+        }
+        if(channel >= ETHPWM_EXT_MARKER)
+        {
+            printk(KERN_ERR LOG_PREFIX  "channel %u is out of range\n", channel);
+            ret = -EINVAL;
+            goto fail;
+        }
+        priv->channel = (uint8_t) channel;
+        if(i < num_pwm)
+        {
+            if(of_property_read_string_index(np, "pwm-names", i, &name))
+            {
+                name = NULL;
+            }
+            ret = init_pwm_output(&pdev->dev, priv, name);
+            if(ret)
+            {
+                goto fail;
+            }
+        } else
+        {
+            /* "pwm" (default) or "pdm" */
+            if(of_property_read_string_index(np, "pwm-gpio-modes", i - num_pwm, &name))
+            {
+                name = NULL;
+            }
+            init_soft_output(priv, edev->pwm_gpios->desc[i - num_pwm], name);
+        }
+        /* direction output of the channel, entries of pwm-dir-gpios may be empty */
+        priv->dir_gpio = devm_gpiod_get_index_optional(&pdev->dev, "pwm-dir", i, GPIOD_OUT_LOW);
+        if(IS_ERR(priv->dir_gpio) || (priv->dir_gpio && gpiod_cansleep(priv->dir_gpio)))
+        {
+            printk(KERN_ERR LOG_PREFIX  "direction GPIO of channel #%hhu is not available\n", priv->channel);
+            priv->dir_gpio = NULL;
+            free_output(priv);
+            ret = -ENODEV;
+            goto fail;
+        }
+        ret = init_channel(priv);
+        if(ret)
+        {
+            free_output(priv);
+            goto fail;
+        }
+        edev->num_channels++;
+    }
+
+    mutex_lock(&channel_map_lock);
+    ret = publish_device(edev);
+    mutex_unlock(&channel_map_lock);
+    if(ret)
+    {
+        goto fail;
+    }
+
+    /* save driver data */
+    platform_set_drvdata(pdev, edev);
+
+    printk(KERN_INFO LOG_PREFIX "device is loaded with %u channels\n", edev->num_channels);
+    
+    return 0;   //return 0 for success
+
+fail:
+    free_device(edev);
+    return ret;
+}
+
+static int ethpwm_remove(struct platform_device *pdev)
+{
+    struct ethpwm_device *edev = platform_get_drvdata(pdev);
+    if(edev)
+    {
+        free_device(edev);
     }
     printk(KERN_INFO LOG_PREFIX "device is removed\n");
     return 0;
@@ -275,7 +1755,47 @@ static struct platform_driver ethpwm_platform_driver =
     .probe = ethpwm_probe,
     .remove = ethpwm_remove,
 };
-module_platform_driver(ethpwm_platform_driver);
+
+/* One protocol handler serves channels of all devices */
+static int __init ethpwm_init(void)
+{
+    int ret;
+
+    if(vlan < -1 || vlan > ETHPWM_VLAN_MAX || pcp < 0 || pcp > ETHPWM_PCP_MAX)
+    {
+        printk(KERN_ERR LOG_PREFIX "vlan must be -1..%d and pcp 0..%d\n", ETHPWM_VLAN_MAX, ETHPWM_PCP_MAX);
+        return -EINVAL;
+    }
+    debugfs_root = debugfs_create_dir("ethpwm", NULL);
+    debugfs_create_u32("frames", 0444, debugfs_root, &rx_stats.frames);
+    debugfs_create_u32("dropped", 0444, debugfs_root, &rx_stats.dropped);
+    debugfs_create_u32("lost", 0444, debugfs_root, &rx_stats.lost);
+    debugfs_create_u32("reordered", 0444, debugfs_root, &rx_stats.reordered);
+    debugfs_create_u32("duplicate", 0444, debugfs_root, &rx_stats.duplicate);
+    debugfs_create_u32("watchdog_timeouts", 0444, debugfs_root, &watchdog_timeouts);
+    hrtimer_init(&watchdog_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    watchdog_timer.function = watchdog_timer_fn;
+    ret = platform_driver_register(&ethpwm_platform_driver);
+    if(ret)
+    {
+        debugfs_remove_recursive(debugfs_root);
+        return ret;
+    }
+    dev_add_pack(&ethpwm_packet_type);
+    printk(KERN_INFO LOG_PREFIX "Protocol handler is installed\n");
+    return 0;
+}
+
+static void __exit ethpwm_exit(void)
+{
+    dev_remove_pack(&ethpwm_packet_type);
+    hrtimer_cancel(&watchdog_timer);
+    platform_driver_unregister(&ethpwm_platform_driver);
+    debugfs_remove_recursive(debugfs_root);
+}
+
+module_init(ethpwm_init);
+module_exit(ethpwm_exit);
 
 MODULE_AUTHOR("Yuri Kobets");
 MODULE_DESCRIPTION("ETHPWM protocol handler");
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/socket.h>
@@ -10,19 +11,41 @@
 #include <getopt.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "ethpwm_proto.h"
 
 #define BUF_SIZ		1024
+#define MAX_CHANNELS    64
+#define MAX_BATCH       64
+
+/* Load mode settings */
+typedef struct
+{
+    double          rate;       /* frames per second, 0 - send one packet and exit */
+    double          duration;   /* s */
+    int             batch;      /* frames per sendmmsg call */
+    int             channels;
+    int             channel;    /* first channel */
+    int             version;    /* 0 - legacy packets, one channel each */
+    int             square;     /* synthetic pattern: 0 - ramp, 1 - square */
+    unsigned int    cycle;      /* frames per period of the synthetic pattern */
+    float*          samples;    /* waveform file, rows * cols duty cycles */
+    unsigned int    rows;
+    unsigned int    cols;
+} load_t;
 
-typedef struct __attribute__((packed))
+/* Command mode state of one channel */
+typedef struct
 {
-    __be32  seq;
-    __u8    channel;
-    __u8    enable;
-    __be16  value;
-    __be16  scale;
-    __be16  offset;
-    __be16  freq;
-} pwm_packet_t;
+    uint8_t     enable;
+    uint16_t    freq;
+    uint16_t    value;
+    uint16_t    scale;
+    uint16_t    offset;
+} cmd_state_t;
 
 void print_usage()
 {
@@ -34,7 +57,380 @@ void print_usage()
            "--freq=NUMBER      - PWM frequency\n"
            "--value=NUMBER     - PWM value\n"
            "--scale=NUMBER     - Scale for PWM\n"
-           "--offset=NUMBER    - Offset for PWM\n");
+           "--offset=NUMBER    - Offset for PWM\n\n"
+           "Load mode, enabled by --rate, needs --iface and --dst only:\n"
+           "--rate=FPS         - frames per second to send\n"
+           "--duration=S       - seconds to send (default 10)\n"
+           "--batch=N          - frames per sendmmsg call, 1..%d (default 1)\n"
+           "--channels=N       - number of channels, 1..%d (default 1)\n"
+           "--channel=N        - first channel (default 0)\n"
+           "--version=0|1|2    - 0 - legacy packets, one channel each, 1|2 - frames with all channels (default 1)\n"
+           "--pattern=ramp|square - synthetic duty cycle, channels are phase shifted (default ramp)\n"
+           "--cycle=N          - frames per pattern period (default 1000)\n"
+           "--waveform=FILE    - replay duty cycles (0..1) from FILE instead, one line per frame,\n"
+           "                     one column per channel, the file is repeated\n"
+           "--enable and --freq apply to all channels (default yes and 1000).\n\n"
+           "Command mode, enabled by --input, needs --iface and --dst only:\n"
+           "--input=FILE|-     - read commands from FILE (e.g. a named pipe) or stdin, one frame per line\n"
+           "--version=0|1|2    - 0 - legacy packets (default), 1|2 - frames with one record\n"
+           "Commands are KEY=VALUE lists, KEY is c[hannel], e[nable], f[req], v[alue], s[cale] or o[ffset],\n"
+           "e.g. 'c=1 e=1 f=1000 v=50 s=100'. Keys not given keep their last value of the channel, the\n"
+           "channel is kept from the previous command, an empty line sends the state again.\n"
+           "Other arguments set the initial state of all channels and the first channel.\n",
+           MAX_BATCH, MAX_CHANNELS);
+}
+
+/* Reads waveform file: whitespace separated duty cycles, one line per frame, # starts a comment */
+static int load_waveform(const char* path, load_t* ld)
+{
+    FILE* f = fopen(path, "r");
+    char line[4096];
+    char* p;
+    char* end;
+    float row[MAX_CHANNELS];
+    float* samples;
+    unsigned int n, i, size = 0;
+
+    if(!f)
+    {
+        perror(path);
+        return -1;
+    }
+    while(fgets(line, sizeof(line), f))
+    {
+        for(n = 0, p = line; n < MAX_CHANNELS; n++, p = end)
+        {
+            row[n] = strtof(p, &end);
+            if(end == p)
+            {
+                break;
+            }
+        }
+        if(!n)
+        {
+            continue;
+        }
+        if(ld->rows == size)
+        {
+            size = size ? size * 2 : 1024;
+            samples = realloc(ld->samples, (size_t) size * MAX_CHANNELS * sizeof(float));
+            if(!samples)
+            {
+                printf("Out of memory\n");
+                fclose(f);
+                return -1;
+            }
+            ld->samples = samples;
+        }
+        /* short lines repeat their last value */
+        for(i = 0; i < MAX_CHANNELS; i++)
+        {
+            ld->samples[ld->rows * MAX_CHANNELS + i] = row[i < n ? i : n - 1];
+        }
+        if(n > ld->cols)
+        {
+            ld->cols = n;
+        }
+        ld->rows++;
+    }
+    fclose(f);
+    if(!ld->rows)
+    {
+        printf("%s: no samples\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Returns duty cycle 0..1 of channel ch (0-based) at tick */
+static double load_duty(const load_t* ld, unsigned long tick, int ch)
+{
+    double duty;
+    unsigned long pos;
+
+    if(ld->samples)
+    {
+        duty = ld->samples[(tick % ld->rows) * MAX_CHANNELS + ch % ld->cols];
+    } else
+    {
+        pos = (tick + (unsigned long) ch * ld->cycle / ld->channels) % ld->cycle;
+        duty = ld->square ? (pos < ld->cycle / 2 ? 1.0 : 0.0) : (double) pos / ld->cycle;
+    }
+    if(duty < 0.0) duty = 0.0;
+    if(duty > 1.0) duty = 1.0;
+    return duty;
+}
+
+/* Builds frame number f after the ethernet header, returns its length */
+static unsigned int load_frame(const load_t* ld, unsigned long f, uint8_t enable, uint16_t freq, uint8_t* buf)
+{
+    pwm_frame_hdr_t* hdr = (pwm_frame_hdr_t*) buf;
+    pwm_record32_t* rec32 = (pwm_record32_t*) (hdr + 1);
+    pwm_record_t* rec16 = (pwm_record_t*) (hdr + 1);
+    ethpwm_state_t st;
+    int ch;
+
+    if(ld->version == 0)
+    {
+        ch = f % ld->channels;
+        ethpwm_encode_packet((pwm_packet_t*) buf, f, ld->channel + ch, enable,
+                             (uint16_t) (load_duty(ld, f / ld->channels, ch) * 0xFFFF), 0xFFFF, 0, freq);
+        return sizeof(pwm_packet_t);
+    }
+    ethpwm_init_frame(hdr, f, ld->version, ETHPWM_FRAME_PWM, ld->channels);
+    for(ch = 0; ch < ld->channels; ch++)
+    {
+        if(ld->version == ETHPWM_VERSION_32)
+        {
+            st.channel = ld->channel + ch;
+            st.enable  = enable;
+            st.flags   = 0;
+            st.duty    = (uint32_t) (load_duty(ld, f, ch) * ETHPWM_DUTY_ONE);
+            st.freq    = (uint32_t) freq << ETHPWM_FREQ_SHIFT;
+            ethpwm_encode_record32(&rec32[ch], &st);
+        } else
+        {
+            ethpwm_encode_record16(&rec16[ch], ld->channel + ch, enable,
+                                   (uint16_t) (load_duty(ld, f, ch) * 0xFFFF), 0xFFFF, 0, freq);
+        }
+    }
+    return ethpwm_frame_len(hdr, BUF_SIZ);
+}
+
+static long long timespec_ns(const struct timespec* ts)
+{
+    return (long long) ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static int cmp_ll(const void* a, const void* b)
+{
+    long long d = *(const long long*) a - *(const long long*) b;
+    return d < 0 ? -1 : d > 0;
+}
+
+/* Sends rate * duration frames in batches on schedule and prints what was achieved */
+static int run_load(int sockfd, struct sockaddr_ll* addr, const struct ether_header* eh, const load_t* ld,
+                    uint8_t enable, uint16_t freq)
+{
+    static uint8_t bufs[MAX_BATCH][sizeof(struct ether_header) + BUF_SIZ];
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iov[MAX_BATCH];
+    unsigned long total = (unsigned long) (ld->rate * ld->duration);
+    unsigned long batches = (total + ld->batch - 1) / ld->batch;
+    long long interval = (long long) (ld->batch * 1e9 / ld->rate);
+    long long* late = malloc((batches ? batches : 1) * sizeof(long long));
+    unsigned long f = 0, b = 0, sent = 0, errors = 0;
+    int last_errno = 0;
+    struct timespec next, now;
+    long long start, sched, elapsed;
+    int n, i, r;
+
+    if(!late)
+    {
+        printf("Out of memory\n");
+        return -1;
+    }
+    memset(msgs, 0, sizeof(msgs));
+    for(i = 0; i < MAX_BATCH; i++)
+    {
+        memcpy(bufs[i], eh, sizeof(struct ether_header));
+        iov[i].iov_base = bufs[i];
+        msgs[i].msg_hdr.msg_name = addr;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_ll);
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    start = sched = timespec_ns(&next);
+    while(f < total)
+    {
+        n = total - f < (unsigned long) ld->batch ? (int) (total - f) : ld->batch;
+        /* frames are built before the wakeup, so it is followed by the send only */
+        for(i = 0; i < n; i++)
+        {
+            iov[i].iov_len = sizeof(struct ether_header) +
+                             load_frame(ld, f + i, enable, freq, bufs[i] + sizeof(struct ether_header));
+        }
+        next.tv_sec = sched / 1000000000LL;
+        next.tv_nsec = sched % 1000000000LL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        late[b++] = timespec_ns(&now) - sched;
+
+        r = sendmmsg(sockfd, msgs, n, 0);
+        if(r < 0)
+        {
+            last_errno = errno;
+            errors += n;
+        } else
+        {
+            if(r < n)
+            {
+                last_errno = EAGAIN;
+            }
+            sent += r;
+            errors += n - r;
+        }
+        f += n;
+        sched += interval;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = timespec_ns(&now) - start;
+
+    printf("frames: %lu sent, %lu send errors", sent, errors);
+    if(errors)
+    {
+        printf(" (last: %s)", strerror(last_errno));
+    }
+    printf("\nrate: %.1f frames/s target, %.1f frames/s achieved, %.1f records/s in %.3f s\n",
+           ld->rate, elapsed > 0 ? sent * 1e9 / elapsed : 0.0,
+           elapsed > 0 ? sent * (ld->version ? ld->channels : 1) * 1e9 / elapsed : 0.0, elapsed / 1e9);
+    if(b)
+    {
+        qsort(late, b, sizeof(long long), cmp_ll);
+        printf("send jitter (us, wakeup after schedule, %lu batches): p50 %.1f, p90 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+               b, late[b / 2] / 1e3, late[b * 9 / 10] / 1e3, late[b * 99 / 100] / 1e3,
+               late[b * 999 / 1000] / 1e3, late[b - 1] / 1e3);
+    }
+    free(late);
+    return errors ? -1 : 0;
+}
+
+/* Applies "KEY=VALUE ..." command to states, returns -1 without changes on error */
+static int parse_command(char* line, int* channel, cmd_state_t* states)
+{
+    static const char* keys = "cefvso";
+    long values[6];
+    int given[6] = {0};
+    char* save;
+    char* tok;
+    char* end;
+    char* eq;
+    cmd_state_t st;
+    int k;
+
+    for(tok = strtok_r(line, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save))
+    {
+        eq = strchr(tok, '=');
+        if(!eq || eq == tok || !strchr(keys, tok[0]) ||
+           (eq - tok > 1 && strncmp(tok, "channel", eq - tok) && strncmp(tok, "enable", eq - tok) &&
+            strncmp(tok, "freq", eq - tok) && strncmp(tok, "value", eq - tok) &&
+            strncmp(tok, "scale", eq - tok) && strncmp(tok, "offset", eq - tok)))
+        {
+            fprintf(stderr, "unknown key: %s\n", tok);
+            return -1;
+        }
+        k = strchr(keys, tok[0]) - keys;
+        errno = 0;
+        values[k] = strtol(eq + 1, &end, 10);
+        if(errno || end == eq + 1 || *end || values[k] < 0 ||
+           values[k] > (k == 0 ? ETHPWM_EXT_MARKER - 1 : k == 1 ? 1 : 0xFFFF))
+        {
+            fprintf(stderr, "incorrect value: %s\n", tok);
+            return -1;
+        }
+        given[k] = 1;
+    }
+    if(given[0])
+    {
+        *channel = values[0];
+    }
+    st = states[*channel];
+    if(given[1]) st.enable = values[1];
+    if(given[2]) st.freq = values[2];
+    if(given[3]) st.value = values[3];
+    if(given[4]) st.scale = values[4];
+    if(given[5]) st.offset = values[5];
+    states[*channel] = st;
+    return 0;
+}
+
+/* Builds frame of one channel after the ethernet header, returns its length */
+static unsigned int cmd_frame(int version, uint32_t seq, int channel, const cmd_state_t* st, uint8_t* buf)
+{
+    pwm_frame_hdr_t* hdr = (pwm_frame_hdr_t*) buf;
+    ethpwm_state_t rec;
+
+    if(version == 0)
+    {
+        ethpwm_encode_packet((pwm_packet_t*) buf, seq, channel, st->enable, st->value, st->scale, st->offset, st->freq);
+        return sizeof(pwm_packet_t);
+    }
+    ethpwm_init_frame(hdr, seq, version, ETHPWM_FRAME_PWM, 1);
+    if(version == ETHPWM_VERSION_32)
+    {
+        rec.channel = channel;
+        rec.enable  = st->enable;
+        rec.flags   = 0;
+        rec.duty    = ethpwm_duty16(st->value, st->scale);
+        rec.freq    = (uint32_t) st->freq << ETHPWM_FREQ_SHIFT;
+        ethpwm_encode_record32((pwm_record32_t*) (hdr + 1), &rec);
+    } else
+    {
+        ethpwm_encode_record16((pwm_record_t*) (hdr + 1), channel, st->enable, st->value, st->scale, st->offset,
+                               st->freq);
+    }
+    return ethpwm_frame_len(hdr, BUF_SIZ);
+}
+
+/* Sends one frame per command line read from path until EOF. The socket, address and
+   ethernet header are prepared once, a command only encodes the frame and sends it. */
+static int run_commands(int sockfd, const struct sockaddr_ll* addr, char* sendbuf, const char* path,
+                        int version, int channel, const cmd_state_t* initial)
+{
+    static cmd_state_t states[ETHPWM_EXT_MARKER];
+    uint8_t* frame = (uint8_t*) sendbuf + sizeof(struct ether_header);
+    char* line = NULL;
+    size_t size = 0;
+    uint32_t seq = 0;
+    unsigned long sent = 0, errors = 0;
+    struct stat st;
+    unsigned int len;
+    FILE* in = stdin;
+    int i, fd;
+
+    for(i = 0; i < ETHPWM_EXT_MARKER; i++)
+    {
+        states[i] = *initial;
+    }
+    if(strcmp(path, "-"))
+    {
+        /* a FIFO is opened for writing as well, so it never sees EOF when a writer closes it */
+        fd = open(path, stat(path, &st) == 0 && S_ISFIFO(st.st_mode) ? O_RDWR : O_RDONLY);
+        in = fd < 0 ? NULL : fdopen(fd, "r");
+        if(!in)
+        {
+            perror(path);
+            return -1;
+        }
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    while(getline(&line, &size, in) >= 0)
+    {
+        if(line[0] == '#' || parse_command(line, &channel, states) != 0)
+        {
+            continue;
+        }
+        len = cmd_frame(version, seq++, channel, &states[channel], frame);
+        if(sendto(sockfd, sendbuf, sizeof(struct ether_header) + len, 0, (const struct sockaddr*) addr,
+                  sizeof(struct sockaddr_ll)) < 0)
+        {
+            perror("sendto");
+            errors++;
+        } else
+        {
+            sent++;
+        }
+    }
+    free(line);
+    if(in != stdin)
+    {
+        fclose(in);
+    }
+    fprintf(stderr, "%lu frames sent, %lu send errors\n", sent, errors);
+    return errors ? -1 : 0;
 }
 
 int main(int argc, char* argv[])
@@ -46,11 +442,15 @@ int main(int argc, char* argv[])
     char sendbuf[BUF_SIZ];
     struct ether_header *eh = (struct ether_header *) sendbuf;
     pwm_packet_t *pwm = (pwm_packet_t *) (sendbuf + sizeof(struct ether_header));
-    pwm_packet_t pwm_data = {0};
+    uint8_t enable = 0;
+    uint16_t freq = 0, value = 0, scale = 0, offset = 0;
     struct sockaddr_ll socket_address;
     char ifName[IFNAMSIZ];
     unsigned char dst_mac[6] = {0};
-    int c, option_index;
+    load_t load = {0, 10.0, 1, 1, 0, -1, 0, 1000, NULL, 0, 0};
+    cmd_state_t initial;
+    const char* input = NULL;
+    int c, option_index, required;
     struct option long_options[] = {
             {"iface",   required_argument,  0, 'i'},
             {"dst",     required_argument,  0, 'd'},
@@ -59,11 +459,21 @@ int main(int argc, char* argv[])
             {"value",   required_argument,  0, 'v'},
             {"scale",   required_argument,  0, 's'},
             {"offset",  required_argument,  0, 'o'},
+            {"rate",    required_argument,  0, 'r'},
+            {"duration", required_argument, 0, 't'},
+            {"batch",   required_argument,  0, 'b'},
+            {"channels", required_argument, 0, 'n'},
+            {"channel", required_argument,  0, 'c'},
+            {"version", required_argument,  0, 'V'},
+            {"pattern", required_argument,  0, 'p'},
+            {"cycle",   required_argument,  0, 'C'},
+            {"waveform", required_argument, 0, 'w'},
+            {"input",   required_argument,  0, 'I'},
             {0,         0,                  0, 0}
     };
     int applied_options[sizeof(long_options) / sizeof(struct option)] = {0};
 
-    while((c = getopt_long(argc, argv, "i:d:e:f:v:s:o:", long_options, &option_index)) != -1)
+    while((c = getopt_long(argc, argv, "i:d:e:f:v:s:o:r:t:b:n:c:V:p:C:w:I:", long_options, &option_index)) != -1)
     {
         switch (c)
         {
@@ -88,10 +498,10 @@ int main(int argc, char* argv[])
             case 'e':
                 if(!strcmp(optarg, "yes"))
                 {
-                    pwm_data.enable = 1;
+                    enable = 1;
                 } else if(!strcmp(optarg, "no"))
                 {
-                    pwm_data.enable = 0;
+                    enable = 0;
                 } else
                 {
                     printf("enable argument can be yes of no\n");
@@ -101,8 +511,8 @@ int main(int argc, char* argv[])
                 break;
             case 'f':
                 errno = 0;
-                pwm_data.freq = htons((uint16_t) strtol(optarg, NULL, 10));
-                if(errno != 0 && pwm_data.freq == 0)
+                freq = (uint16_t) strtol(optarg, NULL, 10);
+                if(errno != 0 && freq == 0)
                 {
                     printf("frequency value is incorrect\n");
                     exit(EXIT_FAILURE);
@@ -111,8 +521,8 @@ int main(int argc, char* argv[])
                 break;
             case 'v':
                 errno = 0;
-                pwm_data.value = htons((uint16_t) strtol(optarg, NULL, 10));
-                if(errno != 0 && pwm_data.value == 0)
+                value = (uint16_t) strtol(optarg, NULL, 10);
+                if(errno != 0 && value == 0)
                 {
                     printf("value format is incorrect\n");
                     exit(EXIT_FAILURE);
@@ -121,8 +531,8 @@ int main(int argc, char* argv[])
                 break;
             case 's':
                 errno = 0;
-                pwm_data.scale = htons((uint16_t) strtol(optarg, NULL, 10));
-                if(errno != 0 && pwm_data.scale == 0)
+                scale = (uint16_t) strtol(optarg, NULL, 10);
+                if(errno != 0 && scale == 0)
                 {
                     printf("scale value is incorrect\n");
                     exit(EXIT_FAILURE);
@@ -131,14 +541,41 @@ int main(int argc, char* argv[])
                 break;
             case 'o':
                 errno = 0;
-                pwm_data.offset = htons((uint16_t) strtol(optarg, NULL, 10));
-                if(errno != 0 && pwm_data.offset == 0)
+                offset = (uint16_t) strtol(optarg, NULL, 10);
+                if(errno != 0 && offset == 0)
                 {
                     printf("offset value is incorrect\n");
                     exit(EXIT_FAILURE);
                 }
                 applied_options[option_index] = 1;
                 break;
+            case 'r': load.rate = atof(optarg); break;
+            case 't': load.duration = atof(optarg); break;
+            case 'b': load.batch = atoi(optarg); break;
+            case 'n': load.channels = atoi(optarg); break;
+            case 'c': load.channel = atoi(optarg); break;
+            case 'V': load.version = atoi(optarg); break;
+            case 'C': load.cycle = (unsigned int) atoi(optarg); break;
+            case 'p':
+                if(!strcmp(optarg, "ramp"))
+                {
+                    load.square = 0;
+                } else if(!strcmp(optarg, "square"))
+                {
+                    load.square = 1;
+                } else
+                {
+                    printf("pattern can be ramp or square\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'I': input = optarg; break;
+            case 'w':
+                if(load_waveform(optarg, &load) != 0)
+                {
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case '?':
                 print_usage();
                 exit(EXIT_SUCCESS);
@@ -148,8 +585,39 @@ int main(int argc, char* argv[])
         }
     }
 
+    /* load and command modes need iface and dst only */
+    required = load.rate > 0 || input ? 2 : 7;
+    if(load.version < 0)
+    {
+        load.version = load.rate > 0 ? ETHPWM_VERSION : 0;
+    }
+    if(input && (load.version > ETHPWM_VERSION_32 || load.channel < 0 || load.channel >= ETHPWM_EXT_MARKER))
+    {
+        printf("Incorrect command mode arguments\n\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+    if(load.rate > 0)
+    {
+        if(!applied_options[2])
+        {
+            enable = 1;
+        }
+        if(!applied_options[3])
+        {
+            freq = 1000;
+        }
+        if(load.batch < 1 || load.batch > MAX_BATCH || load.channels < 1 || load.channels > MAX_CHANNELS ||
+           load.channel < 0 || load.channel + load.channels > ETHPWM_EXT_MARKER ||
+           load.version > ETHPWM_VERSION_32 || load.cycle < 2 || load.duration <= 0)
+        {
+            printf("Incorrect load mode arguments\n\n");
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
     option_index = 0;
-    for(c = 0; long_options[c].name != NULL; c++)
+    for(c = 0; c < required; c++)
     {
         if(!applied_options[c])
         {
@@ -204,12 +672,15 @@ int main(int argc, char* argv[])
     eh->ether_dhost[4] = dst_mac[4];
     eh->ether_dhost[5] = dst_mac[5];
     /* Ethertype field */
-    eh->ether_type = htons(0xEAEB);
+    eh->ether_type = htons(ETHPWM_ETHERTYPE);
     tx_len += sizeof(struct ether_header);
 
-    memcpy(pwm, &pwm_data, sizeof(pwm_packet_t));
+    ethpwm_encode_packet(pwm, 0, load.channel, enable, value, scale, offset, freq);
     tx_len += sizeof(pwm_packet_t);
 
+    memset(&socket_address, 0, sizeof(socket_address));
+    socket_address.sll_family = AF_PACKET;
+    socket_address.sll_protocol = htons(ETHPWM_ETHERTYPE);
     /* Index of the network device */
     socket_address.sll_ifindex = if_idx.ifr_ifindex;
     /* Address length*/
@@ -222,6 +693,25 @@ int main(int argc, char* argv[])
     socket_address.sll_addr[4] = dst_mac[4];
     socket_address.sll_addr[5] = dst_mac[5];
 
+    if(load.rate > 0)
+    {
+        c = run_load(sockfd, &socket_address, eh, &load, enable, freq);
+        free(load.samples);
+        close(sockfd);
+        return c;
+    }
+    if(input)
+    {
+        initial.enable = enable;
+        initial.freq = freq;
+        initial.value = value;
+        initial.scale = scale;
+        initial.offset = offset;
+        c = run_commands(sockfd, &socket_address, sendbuf, input, load.version, load.channel, &initial);
+        close(sockfd);
+        return c;
+    }
+
     /* Send packet */
     if (sendto(sockfd, sendbuf, tx_len, 0, (struct sockaddr*)&socket_address, sizeof(struct sockaddr_ll)) < 0)
     {